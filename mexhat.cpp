@@ -1,9 +1,96 @@
-// mexhat.cpp — SDL2 + OpenGL ES 2.0 spinning Mexican-hat surface (z = sin(r)/r)
+// mexhat.cpp — SDL2 + OpenGL ES 3.0 (ES 2.0 fallback) spinning Mexican-hat surface (z = sin(r)/r)
 // No SDL_test_common.h dependency.
 //
 // Build (Ubuntu):
 //   sudo apt-get update && sudo apt-get install -y libsdl2-dev libgles2-mesa-dev
-//   g++ -O2 mexhat.cpp $(sdl2-config --cflags --libs) -lGLESv2 -o mexhat
+//   g++ -std=c++17 -O2 -pthread mexhat.cpp $(sdl2-config --cflags --libs) -lGLESv2 -o mexhat
+//
+// Options:
+//   -n N        grid resolution (default 128); N>256 needs 32-bit indices or
+//               falls back to 16-bit row bands drawn with one call each
+//   --no-uint   ignore OES_element_index_uint and force the 16-bit band path
+//   --gpu       upload only the (i,j) grid and evaluate z and colour in the
+//               vertex shader (4 bytes per vertex instead of 24)
+//   --animate   modulate freq and zscale every frame through updateSombrero
+//   --lit       diffuse lighting with per-fragment normals from the surface's
+//               analytic gradient (no normal attribute; the same at any N)
+//   --lut       colour each fragment from a 256x1 gradient texture by its
+//               height instead of storing a colour per vertex (CPU vertices
+//               shrink to 12 bytes, or 8 with --half)
+//   --colormap M  gradient for --lut (implied): ramp (default), heat or gray
+//   --half      store CPU mesh positions as OES_vertex_half_float (12 bytes
+//               per vertex instead of 16)
+//   --topology T  index order: list (6 indices per quad, row by row), strip
+//               (degenerate-joined GL_TRIANGLE_STRIP rows, ~2 per quad),
+//               blocked (list order in vertex-cache sized column blocks) or
+//               tiled (28x28-cell tiles with bounding boxes; tiles outside
+//               the view frustum are skipped every frame)
+//   --bench-topology F  render F frames with each topology, vsync off, and
+//               print index bytes and ms/frame for comparison
+//   --threads T worker threads for CPU mesh generation (default: one per core)
+//   --kernel K  z kernel for CPU meshes: scalar (libm reference) or simd
+//               (default; AVX2+FMA or NEON with a polynomial sine, picked at
+//               runtime, scalar if neither is available)
+//   --full-eval with the scalar kernel, evaluate z at every grid vertex
+//               instead of one octant mirrored across the grid (same bits)
+//   --stats     print p50/p95/p99 of the per-frame timings and GL calls
+//               (issued and dropped by the state cache) every 5 s and at exit,
+//               with the high-water mark of the mesh build scratch arenas
+//   --csv FILE  log one row of per-frame timings (ms) per frame to FILE
+//   --gpu-finish  estimate GPU time with glFinish sampling even when
+//               EXT_disjoint_timer_query exists (llvmpipe reports ~0 there)
+//   --bench F   render F frames with vsync off on a fixed camera path (the
+//               animation clock runs at a simulated 60 Hz), then print
+//               frames/s and triangles/s
+//   --offscreen hidden window, draw into an FBO and never swap (for CI or
+//               render farms without a display)
+//   --size WxH  window / offscreen size (default 900x700)
+//   --frames F  quit after F frames
+//   --budget MS hold the frame time near MS: when over budget, render at
+//               down to half resolution (upscaled) and then coarser N or LOD
+//               levels; step back up once there is headroom again. Swaps
+//               use adaptive vsync where the driver has it
+//   --capture FILE  record every frame to FILE, "-" (stdout) or "|COMMAND"
+//               (a pipe, e.g. '|ffmpeg -i - out.mp4'); implies --offscreen
+//               and a 60 Hz --sim-fps unless one is given. Readback is
+//               asynchronous through pixel pack buffers on ES 3.0 and a
+//               writer thread does the I/O; frames that would make the
+//               render loop wait are dropped and counted instead
+//   --capture-format ppm|y4m  concatenated binary PPMs (default) or a
+//               YUV4MPEG2 4:4:4 stream
+//   --lod       pick N from 64/128/256/512/1024 per frame by the surface's
+//               projected size in pixels (levels are built on first use)
+//   --radial    CPU mesh of rings spaced by the surface's curvature, with the
+//               same worst-case error as the N grid in fewer vertices
+//               (sombrero only)
+//   --surface S z(r) to draw: sombrero (default), gaussian or ripple
+//   --microbench FILE  time mesh generation for N = 64..4096 (scalar and
+//               SIMD kernels on one thread, SIMD on the pool), the Mat4
+//               helpers and headless frames of the -n mesh, then write the
+//               results as JSON to FILE ("-" for stdout); implies --offscreen
+//   --cache DIR keep static meshes as binary files in DIR, keyed by their
+//               parameters, and map them back instead of regenerating
+//   --gles2     stay on ES 2.0 even when the driver offers 3.0 (by default a
+//               3.0 context adds 32-bit indices and a uniform block; vertex
+//               array objects are used with 3.0 or OES_vertex_array_object)
+//   --zoom Z    move the camera Z times closer (default 1)
+//   --sim-fps F advance the animation 1/F s per frame instead of by the wall
+//               clock, so every run shows the same frames (--bench uses 60)
+//   --fixed-step HZ  update the animation at a fixed HZ and draw each frame
+//               interpolated between the last two updates
+//   --scene K   draw K CPU surfaces with their own freq/zscale from shared
+//               vertex and index buffers through a draw list sorted by
+//               program and buffer (one call per buffer unless --lit/--lut)
+//   --instances K  draw a wall of K surfaces with their own freq/zscale from
+//               one shared --gpu grid in a single instanced draw call (ES 3.0,
+//               ANGLE_ or EXT_instanced_arrays; K draws without them)
+//
+// Keys:
+//   + / -       double or halve N; the new mesh is generated on a background
+//               thread and uploaded in slices while the old one is drawn
+//   c           with --lut, switch to the next colour map
+//               (keys and window events are handled on the main thread while
+//               a render thread draws, so a slow swap does not delay them)
 //
 // Run notes (UserLAnd/VNC):
 //   - Start a VNC server (e.g. :1), then: export DISPLAY=:1
@@ -16,29 +103,330 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <atomic>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <csignal>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
 
-static const char* VS_SRC = R"(#version 100
-attribute vec3 aPos;
-attribute vec3 aCol;
+// shaders get a #version line plus a block of #defines prepended by
+// compile(); GPU_EVAL computes the surface from the grid index instead of
+// reading it; INSTANCED (with GPU_EVAL) takes the model matrix and surface
+// per instance; LIT shades each fragment with the normal from the surface's
+// closed-form gradient SURFACE_DZ, so shading needs no normal stream and does
+// not depend on N; LUT replaces the per-vertex colour with a lookup of the
+// normalized height in the uLut gradient texture, per fragment.
+// Under ES 3 the uniforms are the Frame block (FrameBlock).
+static const char* VS_SRC = R"(
+#ifdef UNIFORM_BLOCK
+layout(std140) uniform Frame {
+    mat4 uMVP;
+    vec4 uGrid;
+    vec4 uSurface;
+};
+#else
 uniform mat4 uMVP;
+uniform vec4 uGrid;         // xmin, step, display scale, unused
+uniform vec4 uSurface;      // zscale, freq, zmin, 1/(zmax-zmin)
+#endif
+#ifdef LUT
+varying float vT;           // height as 0..1 over [zmin, zmax]
+#else
 varying vec3 vCol;
+#endif
+#ifdef LIT
+varying vec4 vSurf;         // surface x, y before the display scale; zscale, freq
+varying vec4 vLight;        // light direction in model space; display scale
+// a fixed light in view space (up, left, towards the viewer), taken to model
+// space by the inverse rotation, which uMVP carries: with a perspective P and
+// a translating V, its x and y rows are the rotation's scaled and its w row
+// is minus its z row
+vec4 lightInModel() {
+    const vec3 L = vec3(-0.40, 0.60, 0.69);
+    vec3 ex = normalize(vec3(uMVP[0][0], uMVP[1][0], uMVP[2][0]));
+    vec3 ey = normalize(vec3(uMVP[0][1], uMVP[1][1], uMVP[2][1]));
+    vec3 ez = normalize(-vec3(uMVP[0][3], uMVP[1][3], uMVP[2][3]));
+    return vec4(normalize(L.x*ex + L.y*ey + L.z*ez), uGrid.z);
+}
+#endif
+#ifdef GPU_EVAL
+attribute vec2 aGrid;       // (i,j) grid index
+#ifdef INSTANCED
+attribute mat4 aMVP;        // uMVP times the instance's model matrix
+attribute vec4 aSurface;
+#define SURFACE aSurface
+#define TRANSFORM aMVP
+#else
+#define SURFACE uSurface
+#define TRANSFORM uMVP
+#endif
+// same four bands as the CPU ramp, without branches
+vec3 ramp(float t) {
+    float k = 4.0*t;
+    return vec3(clamp(k-2.0, 0.0, 1.0),
+                clamp(k, 0.0, 1.0) - clamp(k-3.0, 0.0, 1.0),
+                1.0 - clamp(k-1.0, 0.0, 1.0));
+}
+void main() {
+    vec2 xy = uGrid.x + aGrid*uGrid.y;
+    float r = max(length(xy), 1e-4);
+    float z = SURFACE_Z(r, SURFACE.x, SURFACE.y);
+    gl_Position = TRANSFORM * vec4(xy*uGrid.z, z, 1.0);
+#ifdef LUT
+    vT = (z-SURFACE.z)*SURFACE.w;
+#else
+    vCol = ramp(clamp((z-SURFACE.z)*SURFACE.w, 0.0, 1.0));
+#endif
+#ifdef LIT
+    vSurf = vec4(xy, SURFACE.x, SURFACE.y);
+    vLight = lightInModel();
+#endif
+}
+#else
+attribute vec3 aPos;
+#ifndef LUT
+attribute vec3 aCol;
+#endif
 void main() {
     gl_Position = uMVP * vec4(aPos, 1.0);
+#ifdef LUT
+    vT = (aPos.z-uSurface.z)*uSurface.w;
+#else
     vCol = aCol;
+#endif
+#ifdef LIT
+    vSurf = vec4(aPos.xy/uGrid.z, uSurface.x, uSurface.y);
+    vLight = lightInModel();
+#endif
 }
+#endif
 )";
 
-static const char* FS_SRC = R"(#version 100
+static const char* FS_SRC = R"(
+#if defined(LIT) && defined(GL_FRAGMENT_PRECISION_HIGH)
+precision highp float;      // the sombrero's gradient cancels near r = 0
+#else
 precision mediump float;
+#endif
+#ifdef LUT
+uniform sampler2D uLut;     // LUT_SIZE x 1, linear
+varying float vT;
+#define LUT_SIZE 256.0
+// texel centres, so 0 and 1 land on the end colours
+#define COLOUR texture2D(uLut, vec2(clamp(vT, 0.0, 1.0)*((LUT_SIZE-1.0)/LUT_SIZE) + 0.5/LUT_SIZE, 0.5)).rgb
+#else
 varying vec3 vCol;
+#define COLOUR vCol
+#endif
+#ifdef LIT
+varying vec4 vSurf;
+varying vec4 vLight;
+#endif
 void main() {
-    gl_FragColor = vec4(vCol, 1.0);
+#ifdef LIT
+    // z(r) over display coordinates scaled by vLight.w: dz/dx = z'(r) x/r / w
+    float r = max(length(vSurf.xy), 1e-4);
+    vec2 g = SURFACE_DZ(r, vSurf.z, vSurf.w) / (r*vLight.w) * vSurf.xy;
+    vec3 n = normalize(vec3(-g, 1.0));
+    if (gl_FrontFacing) n = -n;     // every mesh winds clockwise seen from +z
+    float d = max(dot(n, normalize(vLight.xyz)), 0.0);
+    gl_FragColor = vec4(COLOUR*(0.3 + 0.7*d), 1.0);
+#else
+    gl_FragColor = vec4(COLOUR, 1.0);
+#endif
 }
 )";
 
-static GLuint compile(GLenum type, const char* src) {
+// filled once the context exists; read by the mesh builders
+struct GLCaps {
+    bool es3=false;         // ES 3.0 context: GLSL 3.00 and the Frame block
+    bool vertexArray=false; // ES 3.0 core or OES_vertex_array_object
+    bool uintIndex=false;   // ES 3.0 core or OES_element_index_uint
+    bool halfFloat=false;   // OES_vertex_half_float
+    bool mapBuffer=false;   // OES_mapbuffer
+    bool timerQuery=false;  // EXT_disjoint_timer_query
+    bool depth24=false;     // OES_depth24 renderbuffers
+    bool instanced=false;   // ES 3.0 core, ANGLE_ or EXT_instanced_arrays
+    bool pixelPack=false;   // ES 3.0 core: pixel pack buffers and fences
+};
+static GLCaps caps;
+
+// extension entry points; SDL's GLES2 header declares no prototypes for them
+struct GLExt {
+    PFNGLMAPBUFFEROESPROC MapBuffer=nullptr;
+    PFNGLUNMAPBUFFEROESPROC UnmapBuffer=nullptr;
+    PFNGLGENQUERIESEXTPROC GenQueries=nullptr;
+    PFNGLDELETEQUERIESEXTPROC DeleteQueries=nullptr;
+    PFNGLBEGINQUERYEXTPROC BeginQuery=nullptr;
+    PFNGLENDQUERYEXTPROC EndQuery=nullptr;
+    PFNGLGETQUERYOBJECTUIVEXTPROC GetQueryObjectuiv=nullptr;
+    PFNGLGETQUERYOBJECTUI64VEXTPROC GetQueryObjectui64v=nullptr;
+    // same signatures under all three names
+    PFNGLDRAWELEMENTSINSTANCEDEXTPROC DrawElementsInstanced=nullptr;
+    PFNGLVERTEXATTRIBDIVISOREXTPROC VertexAttribDivisor=nullptr;
+    const char* instancedApi=nullptr;
+    PFNGLGENVERTEXARRAYSOESPROC GenVertexArrays=nullptr;
+    PFNGLBINDVERTEXARRAYOESPROC BindVertexArray=nullptr;
+    PFNGLDELETEVERTEXARRAYSOESPROC DeleteVertexArrays=nullptr;
+    // ES 3.0 core, which the GLES2 headers do not cover
+    GLuint (GL_APIENTRYP GetUniformBlockIndex)(GLuint program, const GLchar* name)=nullptr;
+    void (GL_APIENTRYP UniformBlockBinding)(GLuint program, GLuint block, GLuint binding)=nullptr;
+    void (GL_APIENTRYP BindBufferBase)(GLenum target, GLuint index, GLuint buffer)=nullptr;
+    void* (GL_APIENTRYP MapBufferRange)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)=nullptr;
+    GLboolean (GL_APIENTRYP UnmapBufferES3)(GLenum target)=nullptr;
+    GLsync (GL_APIENTRYP FenceSync)(GLenum condition, GLbitfield flags)=nullptr;
+    GLenum (GL_APIENTRYP ClientWaitSync)(GLsync sync, GLbitfield flags, GLuint64 timeout)=nullptr;
+    void (GL_APIENTRYP DeleteSync)(GLsync sync)=nullptr;
+};
+static GLExt ext;
+static const GLenum GL_UNIFORM_BUFFER_ES3 = 0x8A11;
+static const GLenum GL_PIXEL_PACK_BUFFER_ES3 = 0x88EB;
+static const GLenum GL_MAP_READ_BIT_ES3 = 0x0001, GL_STREAM_READ_ES3 = 0x88E1;
+static const GLenum GL_SYNC_GPU_COMMANDS_COMPLETE_ES3 = 0x9117;
+static const GLenum GL_SYNC_FLUSH_COMMANDS_BIT_ES3 = 0x0001;
+static const GLenum GL_TIMEOUT_EXPIRED_ES3 = 0x911B, GL_WAIT_FAILED_ES3 = 0x911D;
+
+// Last GL state set through the helpers below, which skip calls that would
+// not change it and count the ones they issue. The element buffer, attribute
+// arrays and divisors belong to the bound vertex array, so they are cached
+// for array 0 only and pass straight through while another is bound.
+// Everything that binds, enables or deletes these goes through the helpers.
+static const GLuint UNKNOWN_NAME = ~0u;     // binding the cache cannot vouch for
+static const int CACHED_ATTRIBS = 8;
+struct AttribPointer {
+    GLuint buffer=UNKNOWN_NAME;
+    GLint size=0; GLenum type=0; GLboolean norm=GL_FALSE;
+    GLsizei stride=0; const void* ptr=nullptr;
+    bool operator==(const AttribPointer& o) const {
+        return buffer==o.buffer && size==o.size && type==o.type && norm==o.norm
+            && stride==o.stride && ptr==o.ptr;
+    }
+};
+struct GLStateCache {
+    GLuint program=0, vertexArray=0, arrayBuffer=0, uniformBuffer=0, pixelPackBuffer=0;
+    GLuint elementBuffer=0;                 // of vertex array 0, as are:
+    unsigned enabled=0;
+    AttribPointer pointers[CACHED_ATTRIBS];
+    GLuint divisors[CACHED_ATTRIBS]={};
+    float clearColor[4]={0,0,0,0};
+    GLuint mvpProgram=UNKNOWN_NAME, surfaceProgram=UNKNOWN_NAME;
+    float mvp[16]={}, gridSurface[8]={};
+    uint64_t calls=0, skipped=0;            // GL calls issued / dropped
+};
+static GLStateCache glState;
+
+static void countCalls(int n=1){ glState.calls += n; }
+// true, and counted as dropped, when the call would not change anything
+static bool unchanged(bool same){ if (same) ++glState.skipped; else ++glState.calls; return same; }
+
+static void useProgram(GLuint id){
+    if (unchanged(glState.program == id)) return;
+    glUseProgram(id);
+    glState.program = id;
+}
+static void bindVertexArray(GLuint id){
+    if (unchanged(glState.vertexArray == id)) return;
+    ext.BindVertexArray(id);
+    glState.vertexArray = id;
+}
+static void bindBuffer(GLenum target, GLuint id){
+    GLuint* b = (target == GL_ARRAY_BUFFER) ? &glState.arrayBuffer
+              : (target == GL_UNIFORM_BUFFER_ES3) ? &glState.uniformBuffer
+              : (target == GL_PIXEL_PACK_BUFFER_ES3) ? &glState.pixelPackBuffer
+              : glState.vertexArray ? nullptr : &glState.elementBuffer;
+    if (unchanged(b && *b == id)) return;
+    glBindBuffer(target, id);
+    if (b) *b = id;
+}
+// for uploads: an element buffer bound while a mesh's vertex array is
+// still bound from the last draw would replace that mesh's indices
+static void bindUploadBuffer(GLenum target, GLuint id){
+    if (target == GL_ELEMENT_ARRAY_BUFFER) bindVertexArray(0);
+    bindBuffer(target, id);
+}
+static void enableAttrib(GLuint i, bool on){
+    const bool cached = !glState.vertexArray && i < CACHED_ATTRIBS;
+    if (unchanged(cached && bool(glState.enabled >> i & 1) == on)) return;
+    if (on) glEnableVertexAttribArray(i); else glDisableVertexAttribArray(i);
+    if (cached) glState.enabled = on ? glState.enabled | 1u<<i : glState.enabled & ~(1u<<i);
+}
+static void attribPointer(GLuint i, GLint size, GLenum type, GLboolean norm, GLsizei stride, const void* ptr){
+    AttribPointer p;
+    p.buffer = glState.arrayBuffer; p.size = size; p.type = type; p.norm = norm; p.stride = stride; p.ptr = ptr;
+    const bool cached = !glState.vertexArray && i < CACHED_ATTRIBS;
+    if (unchanged(cached && glState.pointers[i] == p)) return;
+    glVertexAttribPointer(i, size, type, norm, stride, ptr);
+    if (cached) glState.pointers[i] = p;
+}
+static void attribDivisor(GLuint i, GLuint divisor){
+    const bool cached = !glState.vertexArray && i < CACHED_ATTRIBS;
+    if (unchanged(cached && glState.divisors[i] == divisor)) return;
+    ext.VertexAttribDivisor(i, divisor);
+    if (cached) glState.divisors[i] = divisor;
+}
+static void clearColor(float r, float g, float b, float a){
+    const float c[4] = { r, g, b, a };
+    if (unchanged(!memcmp(glState.clearColor, c, sizeof c))) return;
+    glClearColor(r, g, b, a);
+    memcpy(glState.clearColor, c, sizeof c);
+}
+
+// a deleted name may come back from glGen*, so nothing cached may still
+// refer to it
+static void deleteBuffer(GLuint& id){
+    if (!id) return;
+    glDeleteBuffers(1, &id);
+    countCalls();
+    for (GLuint* b : { &glState.arrayBuffer, &glState.uniformBuffer, &glState.elementBuffer, &glState.pixelPackBuffer })
+        if (*b == id) *b = UNKNOWN_NAME;
+    for (AttribPointer& p : glState.pointers) if (p.buffer == id) p.buffer = UNKNOWN_NAME;
+    id = 0;
+}
+static void deleteVertexArrays(std::vector<GLuint>& ids){
+    if (ids.empty()) return;
+    ext.DeleteVertexArrays(GLsizei(ids.size()), ids.data());
+    countCalls();
+    // deleting the bound array reverts to array 0, whose cache still holds
+    for (GLuint id : ids) if (glState.vertexArray == id) glState.vertexArray = 0;
+    ids.clear();
+}
+
+// GLSL ES 3.00 keeps the 1.00 sources through a few renames
+static const char* const VS_PRELUDE_300 =
+    "#version 300 es\n#define UNIFORM_BLOCK\n#define attribute in\n#define varying out\n";
+static const char* const FS_PRELUDE_300 =
+    "#version 300 es\n#define varying in\nout mediump vec4 fragColor;\n#define gl_FragColor fragColor\n"
+    "#define texture2D texture\n";
+
+static GLuint compile(GLenum type, const char* defines, const char* src) {
     GLuint s = glCreateShader(type);
-    glShaderSource(s, 1, &src, nullptr);
+    const char* prelude = !caps.es3 ? "#version 100\n"
+                        : (type == GL_VERTEX_SHADER) ? VS_PRELUDE_300 : FS_PRELUDE_300;
+    const char* parts[3] = { prelude, defines, src };
+    glShaderSource(s, 3, parts, nullptr);
     glCompileShader(s);
     GLint ok = 0; glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
     if (!ok) {
@@ -49,13 +437,16 @@ static GLuint compile(GLenum type, const char* src) {
     return s;
 }
 
-static GLuint linkProgram(const char* vs, const char* fs) {
-    GLuint v = compile(GL_VERTEX_SHADER, vs);
-    GLuint f = compile(GL_FRAGMENT_SHADER, fs);
+static GLuint linkProgram(const char* defines, const char* vs, const char* fs) {
+    GLuint v = compile(GL_VERTEX_SHADER, defines, vs);
+    GLuint f = compile(GL_FRAGMENT_SHADER, defines, fs);
     GLuint p = glCreateProgram();
     glAttachShader(p, v); glAttachShader(p, f);
     glBindAttribLocation(p, 0, "aPos");
+    glBindAttribLocation(p, 0, "aGrid");
     glBindAttribLocation(p, 1, "aCol");
+    glBindAttribLocation(p, 2, "aMVP");     // 2..5, one column each
+    glBindAttribLocation(p, 6, "aSurface");
     glLinkProgram(p);
     GLint ok=0; glGetProgramiv(p, GL_LINK_STATUS, &ok);
     if (!ok) {
@@ -67,6 +458,72 @@ static GLuint linkProgram(const char* vs, const char* fs) {
     return p;
 }
 
+// std140 layout of the Frame uniform block
+struct FrameBlock {
+    float mvp[16];
+    float grid[4];
+    float surface[4];
+};
+
+// ubo != 0: the uniforms live in a FrameBlock buffer on binding point 0
+struct Program {
+    GLuint id=0;
+    bool lit=false, lut=false;  // LIT or LUT: every mesh needs uGrid and uSurface
+    GLint locMVP=-1, locGrid=-1, locSurface=-1;
+    GLuint ubo=0;
+};
+static Program makeProgram(const char* defines){
+    Program p;
+    p.id = linkProgram(defines, VS_SRC, FS_SRC);
+    if (caps.es3) {
+        ext.UniformBlockBinding(p.id, ext.GetUniformBlockIndex(p.id, "Frame"), 0);
+        glGenBuffers(1, &p.ubo);
+        bindBuffer(GL_UNIFORM_BUFFER_ES3, p.ubo);
+        glBufferData(GL_UNIFORM_BUFFER_ES3, sizeof(FrameBlock), nullptr, GL_DYNAMIC_DRAW);
+        ext.BindBufferBase(GL_UNIFORM_BUFFER_ES3, 0, p.ubo);    // generic binding too
+        return p;
+    }
+    p.locMVP = glGetUniformLocation(p.id, "uMVP");
+    p.locGrid = glGetUniformLocation(p.id, "uGrid");
+    p.locSurface = glGetUniformLocation(p.id, "uSurface");
+    return p;
+}
+
+// both setters skip values the program already has
+static void setMVP(const Program& p, const float* mvp){
+    if (unchanged(glState.mvpProgram == p.id && !memcmp(glState.mvp, mvp, sizeof glState.mvp))) return;
+    glState.mvpProgram = p.id;
+    memcpy(glState.mvp, mvp, sizeof glState.mvp);
+    if (!p.ubo) { glUniformMatrix4fv(p.locMVP, 1, GL_FALSE, mvp); return; }
+    bindBuffer(GL_UNIFORM_BUFFER_ES3, p.ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER_ES3, offsetof(FrameBlock, mvp), sizeof(FrameBlock::mvp), mvp);
+}
+
+// uGrid and uSurface, adjacent in the block so one update covers both
+static void setSurface(const Program& p, const float* grid, const float* surface){
+    float gs[8];
+    memcpy(gs, grid, 4*sizeof(float)); memcpy(gs+4, surface, 4*sizeof(float));
+    if (unchanged(glState.surfaceProgram == p.id && !memcmp(glState.gridSurface, gs, sizeof gs))) return;
+    glState.surfaceProgram = p.id;
+    memcpy(glState.gridSurface, gs, sizeof gs);
+    if (!p.ubo) {
+        glUniform4fv(p.locGrid, 1, grid);
+        glUniform4fv(p.locSurface, 1, surface);
+        countCalls();
+        return;
+    }
+    bindBuffer(GL_UNIFORM_BUFFER_ES3, p.ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER_ES3, offsetof(FrameBlock, grid), sizeof gs, gs);
+}
+
+static void destroyProgram(Program& p){
+    glDeleteProgram(p.id);
+    if (glState.program == p.id) glState.program = UNKNOWN_NAME;
+    glState.mvpProgram = glState.surfaceProgram = UNKNOWN_NAME;
+    deleteBuffer(p.ubo);
+    p = Program();
+}
+
 // simple column-major mat4 helpers
 struct Mat4 {
     float m[16];
@@ -74,7 +531,56 @@ struct Mat4 {
         Mat4 A{}; for(int i=0;i<16;++i) A.m[i]=(i%5==0)?1.f:0.f; return A;
     }
 };
-static Mat4 mul(const Mat4& A, const Mat4& B){
+// a fused multiply-add rounds once where mul() rounds twice; GCC contracts
+// a*b + c by default (-ffp-contract=fast on aarch64, even across NEON
+// intrinsics) and clang within an expression, so the functions that have to
+// agree bit for bit opt out
+#if defined(__clang__)
+#define NO_FP_CONTRACT
+#define FP_CONTRACT_OFF _Pragma("clang fp contract(off)")
+#elif defined(__GNUC__)
+#define NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#define FP_CONTRACT_OFF
+#else
+#define NO_FP_CONTRACT
+#define FP_CONTRACT_OFF
+#endif
+// column c of A*B is A's columns weighted by B's column c; the vector forms
+// keep the scalar order of the sum and use no FMA, so all three agree bit
+// for bit
+#if defined(__SSE__)
+NO_FP_CONTRACT static Mat4 mul(const Mat4& A, const Mat4& B){
+    FP_CONTRACT_OFF
+    const __m128 a0 = _mm_loadu_ps(A.m), a1 = _mm_loadu_ps(A.m+4);
+    const __m128 a2 = _mm_loadu_ps(A.m+8), a3 = _mm_loadu_ps(A.m+12);
+    Mat4 R;
+    for(int c=0;c<4;++c){
+        const float* b = B.m + c*4;
+        __m128 r = _mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(b[0])), _mm_mul_ps(a1, _mm_set1_ps(b[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(b[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(b[3])));
+        _mm_storeu_ps(R.m + c*4, r);
+    }
+    return R;
+}
+#elif defined(__aarch64__)
+NO_FP_CONTRACT static Mat4 mul(const Mat4& A, const Mat4& B){
+    FP_CONTRACT_OFF
+    const float32x4_t a0 = vld1q_f32(A.m), a1 = vld1q_f32(A.m+4);
+    const float32x4_t a2 = vld1q_f32(A.m+8), a3 = vld1q_f32(A.m+12);
+    Mat4 R;
+    for(int c=0;c<4;++c){
+        const float* b = B.m + c*4;
+        float32x4_t r = vaddq_f32(vmulq_n_f32(a0, b[0]), vmulq_n_f32(a1, b[1]));
+        r = vaddq_f32(r, vmulq_n_f32(a2, b[2]));
+        r = vaddq_f32(r, vmulq_n_f32(a3, b[3]));
+        vst1q_f32(R.m + c*4, r);
+    }
+    return R;
+}
+#else
+NO_FP_CONTRACT static Mat4 mul(const Mat4& A, const Mat4& B){
+    FP_CONTRACT_OFF
     Mat4 R{}; 
     for(int r=0;r<4;++r) for(int c=0;c<4;++c){
         R.m[c*4+r] = A.m[0*4+r]*B.m[c*4+0] + A.m[1*4+r]*B.m[c*4+1]
@@ -82,6 +588,7 @@ static Mat4 mul(const Mat4& A, const Mat4& B){
     }
     return R;
 }
+#endif
 static Mat4 perspective(float fovy, float aspect, float znear, float zfar){
     float f = 1.0f / tanf(fovy*0.5f);
     Mat4 P{}; 
@@ -90,157 +597,3120 @@ static Mat4 perspective(float fovy, float aspect, float znear, float zfar){
     return P;
 }
 static Mat4 rotateY(float a){
-    Mat4 R=Mat4::identity(); float c=cosf(a), s=sinf(a);
-    R.m[0]=c; R.m[2]=s; R.m[8]=-s; R.m[10]=c; return R;
+    const float c=cosf(a), s=sinf(a);
+    return Mat4{{ c,0,s,0,  0,1,0,0,  -s,0,c,0,  0,0,0,1 }};
 }
 static Mat4 rotateX(float a){
-    Mat4 R=Mat4::identity(); float c=cosf(a), s=sinf(a);
-    R.m[5]=c; R.m[6]=s; R.m[9]=-s; R.m[10]=c; return R;
+    const float c=cosf(a), s=sinf(a);
+    return Mat4{{ 1,0,0,0,  0,c,s,0,  0,-s,c,0,  0,0,0,1 }};
 }
 static Mat4 translate(float x,float y,float z){
     Mat4 T=Mat4::identity(); T.m[12]=x; T.m[13]=y; T.m[14]=z; return T;
 }
 
+// fixed set of threads that split [0,n) into one contiguous chunk each; the
+// caller runs chunk 0 and waits for the rest. Jobs are passed as a plain
+// function pointer + context so a parallelFor never allocates.
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads=0) {
+        if (threads<=0) threads = (int)std::thread::hardware_concurrency();
+        count = threads<1 ? 1 : threads;
+        for (int t=1; t<count; ++t) workers.emplace_back([this,t]{ run(t); });
+    }
+    ~WorkerPool() {
+        { std::lock_guard<std::mutex> l(mu); stop=true; }
+        cvWork.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+    int size() const { return count; }
+
+    // fn(begin, end) for every chunk; returns once all of them are done
+    template<class F>
+    void parallelFor(int n, F&& fn) {
+        if (count==1 || n<2) { fn(0, n); return; }
+        typedef typename std::remove_reference<F>::type Fn;
+        {
+            std::lock_guard<std::mutex> l(mu);
+            jobN = n; jobCtx = (void*)&fn;
+            jobCall = [](void* ctx, int b, int e){ (*(Fn*)ctx)(b, e); };
+            pending = count-1;
+            ++generation;
+        }
+        cvWork.notify_all();
+        chunk(0, fn);
+        std::unique_lock<std::mutex> l(mu);
+        cvDone.wait(l, [this]{ return pending==0; });
+    }
+
+private:
+    template<class F>
+    void chunk(int t, F& fn) {
+        const int b = int(int64_t(jobN)*t/count), e = int(int64_t(jobN)*(t+1)/count);
+        if (b<e) fn(b, e);
+    }
+    void run(int t) {
+        uint64_t seen = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> l(mu);
+            cvWork.wait(l, [&]{ return stop || generation!=seen; });
+            if (stop) return;
+            seen = generation;
+            void* ctx = jobCtx; void (*call)(void*,int,int) = jobCall;
+            l.unlock();
+            auto fn = [&](int b, int e){ call(ctx, b, e); };
+            chunk(t, fn);
+            l.lock();
+            if (--pending==0) cvDone.notify_one();
+        }
+    }
+
+    int count = 1;
+    std::vector<std::thread> workers;
+    std::mutex mu;
+    std::condition_variable cvWork, cvDone;
+    uint64_t generation = 0;
+    int pending = 0;
+    bool stop = false;
+    int jobN = 0;
+    void* jobCtx = nullptr;
+    void (*jobCall)(void*, int, int) = nullptr;
+};
+
+static int workerThreads = 0;   // --threads; 0 = one per core
+// the pool takes one job at a time. It belongs to the GL thread: main during
+// setup, then the render thread (main only handles events from there on).
+// Other threads (the background MeshBuilder) set evalInline and run their
+// loops themselves.
+static thread_local bool evalInline = false;
+static WorkerPool& workerPool(){
+    static WorkerPool pool(workerThreads), inlinePool(1);
+    return evalInline ? inlinePool : pool;
+}
+
+// allowES3=false treats an ES 3 context (which Mesa hands out even for a
+// 2.0 request) as plain ES 2.0
+static void detectCaps(bool allowUint, bool allowES3){
+    const char* version = (const char*)glGetString(GL_VERSION);
+    const bool es3 = version && !strncmp(version, "OpenGL ES ", 10) && version[10] >= '3';
+    if (es3 && allowES3) {
+        ext.GetUniformBlockIndex = (GLuint (GL_APIENTRYP)(GLuint, const GLchar*))SDL_GL_GetProcAddress("glGetUniformBlockIndex");
+        ext.UniformBlockBinding = (void (GL_APIENTRYP)(GLuint, GLuint, GLuint))SDL_GL_GetProcAddress("glUniformBlockBinding");
+        ext.BindBufferBase = (void (GL_APIENTRYP)(GLenum, GLuint, GLuint))SDL_GL_GetProcAddress("glBindBufferBase");
+        caps.es3 = ext.GetUniformBlockIndex && ext.UniformBlockBinding && ext.BindBufferBase;
+        ext.MapBufferRange = (void* (GL_APIENTRYP)(GLenum, GLintptr, GLsizeiptr, GLbitfield))SDL_GL_GetProcAddress("glMapBufferRange");
+        ext.UnmapBufferES3 = (GLboolean (GL_APIENTRYP)(GLenum))SDL_GL_GetProcAddress("glUnmapBuffer");
+        ext.FenceSync = (GLsync (GL_APIENTRYP)(GLenum, GLbitfield))SDL_GL_GetProcAddress("glFenceSync");
+        ext.ClientWaitSync = (GLenum (GL_APIENTRYP)(GLsync, GLbitfield, GLuint64))SDL_GL_GetProcAddress("glClientWaitSync");
+        ext.DeleteSync = (void (GL_APIENTRYP)(GLsync))SDL_GL_GetProcAddress("glDeleteSync");
+        caps.pixelPack = caps.es3 && ext.MapBufferRange && ext.UnmapBufferES3
+                      && ext.FenceSync && ext.ClientWaitSync && ext.DeleteSync;
+    }
+    const char* vao[3] = { "glGenVertexArrays", "glBindVertexArray", "glDeleteVertexArrays" };
+    if (caps.es3 || SDL_GL_ExtensionSupported("GL_OES_vertex_array_object")) {
+        if (!caps.es3) { vao[0] = "glGenVertexArraysOES"; vao[1] = "glBindVertexArrayOES"; vao[2] = "glDeleteVertexArraysOES"; }
+        ext.GenVertexArrays = (PFNGLGENVERTEXARRAYSOESPROC)SDL_GL_GetProcAddress(vao[0]);
+        ext.BindVertexArray = (PFNGLBINDVERTEXARRAYOESPROC)SDL_GL_GetProcAddress(vao[1]);
+        ext.DeleteVertexArrays = (PFNGLDELETEVERTEXARRAYSOESPROC)SDL_GL_GetProcAddress(vao[2]);
+        caps.vertexArray = ext.GenVertexArrays && ext.BindVertexArray && ext.DeleteVertexArrays;
+    }
+    caps.uintIndex = allowUint && (caps.es3 || SDL_GL_ExtensionSupported("GL_OES_element_index_uint"));
+    caps.halfFloat = SDL_GL_ExtensionSupported("GL_OES_vertex_half_float");
+    caps.depth24 = SDL_GL_ExtensionSupported("GL_OES_depth24");
+    if (SDL_GL_ExtensionSupported("GL_OES_mapbuffer")) {
+        ext.MapBuffer = (PFNGLMAPBUFFEROESPROC)SDL_GL_GetProcAddress("glMapBufferOES");
+        ext.UnmapBuffer = (PFNGLUNMAPBUFFEROESPROC)SDL_GL_GetProcAddress("glUnmapBufferOES");
+        caps.mapBuffer = ext.MapBuffer && ext.UnmapBuffer;
+    }
+    if (SDL_GL_ExtensionSupported("GL_EXT_disjoint_timer_query")) {
+        ext.GenQueries = (PFNGLGENQUERIESEXTPROC)SDL_GL_GetProcAddress("glGenQueriesEXT");
+        ext.DeleteQueries = (PFNGLDELETEQUERIESEXTPROC)SDL_GL_GetProcAddress("glDeleteQueriesEXT");
+        ext.BeginQuery = (PFNGLBEGINQUERYEXTPROC)SDL_GL_GetProcAddress("glBeginQueryEXT");
+        ext.EndQuery = (PFNGLENDQUERYEXTPROC)SDL_GL_GetProcAddress("glEndQueryEXT");
+        ext.GetQueryObjectuiv = (PFNGLGETQUERYOBJECTUIVEXTPROC)SDL_GL_GetProcAddress("glGetQueryObjectuivEXT");
+        ext.GetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC)SDL_GL_GetProcAddress("glGetQueryObjectui64vEXT");
+        caps.timerQuery = ext.GenQueries && ext.DeleteQueries && ext.BeginQuery && ext.EndQuery
+                       && ext.GetQueryObjectuiv && ext.GetQueryObjectui64v;
+    }
+    static const char* const instancedApis[3][3] = {
+        { "ES 3.0", "glDrawElementsInstanced", "glVertexAttribDivisor" },
+        { "ANGLE_instanced_arrays", "glDrawElementsInstancedANGLE", "glVertexAttribDivisorANGLE" },
+        { "EXT_instanced_arrays", "glDrawElementsInstancedEXT", "glVertexAttribDivisorEXT" },
+    };
+    for (int k=0; k<3 && !caps.instanced; ++k){
+        const std::string name = std::string("GL_") + instancedApis[k][0];
+        if (k==0 ? !caps.es3 : !SDL_GL_ExtensionSupported(name.c_str())) continue;
+        ext.DrawElementsInstanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)SDL_GL_GetProcAddress(instancedApis[k][1]);
+        ext.VertexAttribDivisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)SDL_GL_GetProcAddress(instancedApis[k][2]);
+        caps.instanced = ext.DrawElementsInstanced && ext.VertexAttribDivisor;
+        if (caps.instanced) ext.instancedApi = instancedApis[k][0];
+    }
+}
+
+// Bump allocator for the transient bytes of a mesh build (staged vertex and
+// index buffers, the unmapped upload copy). reset() drops everything at once
+// and keeps the memory; an allocation that does not fit gets a side block
+// until then, and the next reset regrows the main block to the high-water
+// mark, so after the largest N has been built once nothing is allocated.
+class ScratchArena {
+public:
+    static const size_t ALIGN = 64;
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+    ~ScratchArena() {
+        for (void* p : side) free(p);
+        free(base);
+    }
+    void* alloc(size_t bytes) {
+        bytes = (bytes + ALIGN-1) & ~(ALIGN-1);
+        live += bytes;
+        if (live > highWater) highWater = live;
+        if (top + bytes <= capacity) { void* p = base + top; top += bytes; return p; }
+        void* p = aligned_alloc(ALIGN, bytes ? bytes : ALIGN);
+        if (!p) throw std::bad_alloc();
+        side.push_back(p);
+        return p;
+    }
+    // everything handed out since the last reset is dead
+    void reset() {
+        for (void* p : side) free(p);
+        side.clear();
+        if (highWater > capacity) {
+            free(base);
+            base = (GLubyte*)aligned_alloc(ALIGN, highWater);
+            if (!base) throw std::bad_alloc();
+            capacity = highWater.load();
+        }
+        top = live = 0;
+    }
+    // readable from other threads, for --stats
+    size_t highWaterBytes() const { return highWater; }
+private:
+    GLubyte* base = nullptr;
+    size_t top = 0, live = 0, capacity = 0;
+    std::atomic<size_t> highWater{0};
+    std::vector<void*> side;
+};
+// the GL thread's arena: unmapped upload copies and mesh cache misses. Its
+// allocations never outlive the build that made them.
+static ScratchArena glArena;
+
+// (re)specify the bound buffer as `bytes` of `usage` and have fill() write its
+// contents: straight into a mapping with OES_mapbuffer, else into a staging
+// copy. A caller-owned `keep` copy is reused between calls (dynamic meshes).
+template<class F>
+static void fillBuffer(GLenum target, size_t bytes, GLenum usage, F&& fill,
+                       std::vector<GLubyte>* keep=nullptr){
+    if (caps.mapBuffer) {
+        glBufferData(target, GLsizeiptr(bytes), nullptr, usage);
+        if (void* p = ext.MapBuffer(target, GL_WRITE_ONLY_OES)) {
+            fill(p);
+            if (ext.UnmapBuffer(target)) return;
+            // storage was lost while mapped; fall through and upload a copy
+        }
+    }
+    if (keep) {
+        keep->resize(bytes);
+        fill((void*)keep->data());
+        glBufferData(target, GLsizeiptr(bytes), nullptr, usage);    // orphan
+        glBufferSubData(target, 0, GLsizeiptr(bytes), keep->data());
+    } else {
+        void* stage = glArena.alloc(bytes);
+        fill(stage);
+        glBufferData(target, GLsizeiptr(bytes), stage, usage);
+        glArena.reset();
+    }
+}
+
+// Mesh builders create their buffers through uploadBuffer. While a thread
+// has meshStaging set (the background MeshBuilder, a mesh cache miss) no GL
+// call is made: the contents go to a staged block that uploadStaged turns
+// into the buffer later, on the GL thread. The blocks come from the
+// staging's arena and live until its owner resets it after the upload.
+struct StagedBuffer {
+    GLenum target, usage;
+    GLubyte* bytes;
+    size_t size;
+};
+struct MeshStaging {
+    ScratchArena* arena = nullptr;
+    std::vector<StagedBuffer> buffers;  // in creation order: vertices, indices
+    size_t current = 0, sent = 0;       // uploadStaged progress
+};
+static thread_local MeshStaging* meshStaging = nullptr;
+
+template<class F>
+static void uploadBuffer(GLuint& id, GLenum target, size_t bytes, GLenum usage, F&& fill,
+                         std::vector<GLubyte>* keep=nullptr){
+    if (meshStaging) {
+        GLubyte* p = (GLubyte*)meshStaging->arena->alloc(bytes);
+        meshStaging->buffers.push_back(StagedBuffer{target, usage, p, bytes});
+        fill((void*)p);
+        return;
+    }
+    glGenBuffers(1,&id); bindUploadBuffer(target,id);
+    fillBuffer(target, bytes, usage, fill, keep);
+}
+
+// interleaved vertex formats for CPU-built meshes, colour as normalized RGBA8
+struct Vertex {
+    float pos[3];
+    GLubyte col[4];
+};
+struct VertexHalf {
+    GLushort pos[4];    // xyz + 1.0, padded so col stays 4-byte aligned
+    GLubyte col[4];
+};
+// --lut: the colour comes from the height in the fragment shader
+struct VertexPos {
+    float pos[3];
+};
+struct VertexHalfPos {
+    GLushort pos[4];
+};
+
+// binary16 without denormals: tiny values flush to zero, large ones to inf
+static GLushort toHalf(float f){
+    uint32_t u; memcpy(&u, &f, 4);
+    const uint32_t sign = (u>>16) & 0x8000u;
+    const int32_t e = int32_t((u>>23) & 0xffu) - 127 + 15;
+    const uint32_t mant = u & 0x7fffffu;
+    if (e <= 0) return GLushort(sign);
+    if (e >= 31) return GLushort(sign | 0x7c00u);
+    uint32_t h = sign | (uint32_t(e)<<10) | (mant>>13);
+    if (mant & 0x1000u) ++h;    // round half up; a carry into the exponent is still correct
+    return GLushort(h);
+}
+static void setPos(Vertex& v, float x, float y, float z){ v.pos[0]=x; v.pos[1]=y; v.pos[2]=z; }
+static void setPos(VertexHalf& v, float x, float y, float z){
+    v.pos[0]=toHalf(x); v.pos[1]=toHalf(y); v.pos[2]=toHalf(z); v.pos[3]=0x3c00;
+}
+static void setPos(VertexPos& v, float x, float y, float z){ v.pos[0]=x; v.pos[1]=y; v.pos[2]=z; }
+static void setPos(VertexHalfPos& v, float x, float y, float z){
+    v.pos[0]=toHalf(x); v.pos[1]=toHalf(y); v.pos[2]=toHalf(z); v.pos[3]=0x3c00;
+}
+
+// one glDrawElements per range; baseVertex rebases the attribute pointers so a
+// 16-bit index buffer can address any row band of a larger vertex buffer
+struct DrawRange {
+    GLsizei first=0, count=0;   // in indices
+    GLsizei baseVertex=0;
+};
+enum Topology { TOPO_LIST, TOPO_STRIP, TOPO_BLOCKED, TOPO_TILED, TOPO_COUNT };
+static const char* const topologyNames[TOPO_COUNT] = { "list", "strip", "blocked", "tiled" };
+
+// build-time choices shared by the mesh builders
+struct MeshOptions {
+    bool dynamic=false;     // GL_DYNAMIC_DRAW buffers for updateSombrero
+    bool halfPos=false;     // VertexHalf when OES_vertex_half_float exists
+    bool lut=false;         // positions only, coloured by the LUT texture
+    Topology topology=TOPO_LIST;
+    bool radial=false;      // makeSombreroRadial rings instead of the grid
+};
+
+// One ring of a radial mesh. Its vertices lie on two angular grids: arcSeg
+// steps where the ring stays inside the square, and edgeSeg steps over the
+// edge it clamps onto that the ring inside did not already cover.
+struct RadialRing {
+    float r=0;
+    double innerArc=0, arc=0;   // clamped half-arcs of the ring inside and of this one
+    int arcSeg=1, edgeSeg=0;
+    int first=0;                // first vertex the ring owns
+};
+
+// A TOPO_TILED block of TILE_CELLS x TILE_CELLS cells inside one range,
+// with its box in drawn coordinates for the frustum test. The z bounds come
+// from the radii the tile spans, so they follow zscale/freq without the
+// vertices (GPU_EVAL meshes have none on the CPU).
+struct GridTile {
+    int range=0;
+    GLsizei first=0, count=0;   // in indices
+    float x0=0, x1=0, y0=0, y1=0;
+    float rmin=0, rmax=0;       // surface radii
+    float zmin=0, zmax=0;
+};
+// consecutive visible tiles of one range, drawn with one call
+struct TileRun {
+    int range=0;
+    GLsizei first=0, count=0;
+};
+
 struct Mesh {
-    GLuint vbo=0, cbo=0, ibo=0;
+    GLuint vbo=0, ibo=0;
+    GLenum prim=GL_TRIANGLES;
+    bool halfPos=false;     // VertexHalf instead of Vertex
+    bool lut=false;         // VertexPos / VertexHalfPos: no colour
+    size_t vertices=0;
     GLsizei indexCount=0;
+    GLenum indexType=GL_UNSIGNED_SHORT;
+    size_t triangles=0;     // excluding strip degenerates
+    std::vector<DrawRange> ranges;
+    // surface the mesh was built for; GPU_EVAL meshes feed these to uniforms
+    bool gpuEval=false;
+    int N=0;
+    float radius=0, zscale=0, freq=0, zmin=0, zmax=0;
+    bool dynamic=false;
+    std::vector<GLubyte> host;  // staging for dynamic meshes without OES_mapbuffer
+    std::vector<RadialRing> rings;  // makeSombreroRadial, centre first
+    std::vector<GridTile> tiles;    // TOPO_TILED, in index order
+    std::vector<TileRun> visible;   // tiles left by the last cullTiles
+    size_t visibleTriangles=0;
+    std::vector<GLuint> vaos;       // one per range, see makeVertexArrays
+    GLuint vaoInstances=0;          // instance buffer the vaos were made with
 };
-static Mesh makeSombrero(int N=128, float radius=6.0f, float zscale=1.0f, float freq=1.0f) {
-    if (N<3) N=3;
-    const int V = N*N;
-    std::vector<float> pos; pos.reserve(V*3);
-    std::vector<float> col; col.reserve(V*3);
-    const float xmin=-radius, xmax=radius, ymin=-radius, ymax=radius;
-
-    // compute positions and z-range
-    std::vector<float> zs; zs.reserve(V);
-    float zmin=1e9f, zmax=-1e9f;
-    for (int j=0;j<N;++j){
-        float ty = float(j)/(N-1);
-        float y = ymin + ty*(ymax-ymin);
-        for (int i=0;i<N;++i){
-            float tx = float(i)/(N-1);
-            float x = xmin + tx*(xmax-xmin);
-            float r = sqrtf(x*x + y*y);
-            if (r < 1e-4f) r = 1e-4f;
-            float z = zscale * (sinf(freq*r)/r);
-            pos.push_back((x/radius)*1.5f);
-            pos.push_back((y/radius)*1.5f);
-            pos.push_back(z);
-            zs.push_back(z);
-            if (z<zmin) zmin=z; if (z>zmax) zmax=z;
+
+// cells per column block in TOPO_BLOCKED: two rows of CACHE_BLOCK+1 vertices
+// stay inside a 32-entry post-transform cache, so a vertex is shaded ~once
+static const int CACHE_BLOCK = 14;
+// cells per tile side in TOPO_TILED; each tile is two column blocks wide
+static const int TILE_CELLS = 2*CACHE_BLOCK;
+
+// the tiles of TOPO_TILED over `rows` vertex rows, in index order, as cell
+// ranges [i0,i1) x [j0,j1)
+template<class F>
+static constexpr void forTiles(int N, int rows, F&& fn){
+    for (int j0=0; j0<rows-1; j0+=TILE_CELLS)
+        for (int i0=0; i0<N-1; i0+=TILE_CELLS)
+            fn(i0, std::min(i0+TILE_CELLS, N-1), j0, std::min(j0+TILE_CELLS, rows-1));
+}
+
+// two tris per cell over [i0,i1) x [j0,j1), in column blocks `block` wide
+template<class I, class At>
+static constexpr I* writeCells(I* out, At at, int i0, int i1, int j0, int j1, int block){
+    for (int b0=i0; b0<i1; b0+=block){
+        const int b1 = (b0+block < i1) ? b0+block : i1;
+        for (int j=j0;j<j1;++j){
+            for (int i=b0;i<b1;++i){
+                I a = at(i,j), b = at(i+1,j), c = at(i,j+1), d = at(i+1,j+1);
+                out[0]=a; out[1]=c; out[2]=b;
+                out[3]=b; out[4]=c; out[5]=d;
+                out += 6;
+            }
         }
     }
-    float range = (zmax - zmin); if (range < 1e-6f) range = 1.0f;
+    return out;
+}
+
+// index count of writeGridIndices for `rows` vertex rows
+static constexpr size_t gridIndexCount(int N, int rows, Topology topo){
+    if (rows < 2) return 0;
+    if (topo == TOPO_STRIP) return size_t(rows-1)*2*N + size_t(rows-2)*2;
+    return size_t(rows-1)*(N-1)*6;
+}
+
+// vertex rows [j0, j0+rows), indices relative to row j0; returns the end
+template<class I>
+static constexpr I* writeGridIndices(I* out, int N, int rows, Topology topo){
+    auto at = [N](int i, int j){ return I(j*N + i); };
+    if (topo == TOPO_STRIP) {
+        for (int j=0;j<rows-1;++j){
+            // repeat the last and first index to join rows with degenerates;
+            // both runs are even so the winding is kept
+            if (j>0) { out[0] = out[-1]; out[1] = at(0,j); out += 2; }
+            for (int i=0;i<N;++i){ *out++ = at(i,j); *out++ = at(i,j+1); }
+        }
+        return out;
+    }
+    if (topo == TOPO_TILED) {
+        forTiles(N, rows, [&](int i0, int i1, int j0, int j1){
+            out = writeCells(out, at, i0, i1, j0, j1, CACHE_BLOCK);
+        });
+        return out;
+    }
+    // TOPO_LIST is a single block as wide as the grid
+    return writeCells(out, at, 0, N-1, 0, rows-1, (topo == TOPO_BLOCKED) ? CACHE_BLOCK : N-1);
+}
+
+// TOPO_LIST indices of an N grid, filled in at compile time for the sizes
+// that come up most (the default -n 128 and the lowest LOD level) so their
+// upload is a copy out of the binary
+template<int N>
+struct EmbeddedIndices {
+    static constexpr size_t count = gridIndexCount(N, N, TOPO_LIST);
+    static_assert(N*N <= 65536, "embedded indices are 16-bit");
+    GLushort data[count] = {};
+    constexpr EmbeddedIndices(){ writeGridIndices(data, N, N, TOPO_LIST); }
+};
+static constexpr EmbeddedIndices<64> embedded64;
+static constexpr EmbeddedIndices<128> embedded128;
+
+static const GLushort* embeddedIndices(int N, Topology topo){
+    if (topo != TOPO_LIST) return nullptr;
+    return N == 64 ? embedded64.data : N == 128 ? embedded128.data : nullptr;
+}
 
-    // colors by height
-    for (int v=0; v<V; ++v){
-        float t = (zs[v]-zmin)/range; // 0..1
-        float r,g,b;
-        if (t < 0.25f) { float k=t/0.25f; r=0.0f; g=k;   b=1.0f; }
-        else if (t < 0.50f) { float k=(t-0.25f)/0.25f; r=0.0f; g=1.0f; b=1.0f-k; }
-        else if (t < 0.75f) { float k=(t-0.50f)/0.25f; r=k;   g=1.0f; b=0.0f; }
-        else { float k=(t-0.75f)/0.25f; r=1.0f; g=1.0f-k; b=0.0f; }
-        col.push_back(r); col.push_back(g); col.push_back(b);
+typedef void (*RowKernel)(const float* xx, float yy, float zscale, float freq, int n, float* z);
+
+// Surfaces z(x^2+y^2). Each one gives its scalar value, the exact z-range over
+// a band of radii [rmin,rmax] (for colours and tile bounds), the same
+// expression for GPU_EVAL and its derivative dz/dr for LIT. Depending on
+// x^2+y^2 alone keeps the grid's octant mirroring valid. Another surface is
+// a struct with these members and an entry in SURFACES.
+struct Sombrero {
+    static float z(float rr, float zscale, float freq){
+        float r = sqrtf(rr);
+        if (r < 1e-4f) r = 1e-4f;
+        return zscale * (sinf(freq*r)/r);
+    }
+    // both ends plus every extremum of sin(x)/x between them
+    static void range(double rmin, double rmax, float zscale, float freq, float& zmin, float& zmax){
+        auto zat = [&](double r){ return float(zscale*(sin(freq*r)/r)); };
+        zmin = fminf(zat(rmin), zat(rmax));
+        zmax = fmaxf(zat(rmin), zat(rmax));
+        const double f = fabs(freq);
+        if (f <= 0.0) return;
+        for (int k=1;; ++k){
+            // k-th root of tan x = x, by Newton on x cos x - sin x
+            double x = (k+0.5)*M_PI - 1.0/((k+0.5)*M_PI);
+            for (int it=0; it<4; ++it) x -= (x*cos(x) - sin(x)) / (-x*sin(x));
+            const double r = x/f;
+            if (r >= rmax) break;
+            if (r <= rmin) continue;
+            zmin = fminf(zmin, zat(r));
+            zmax = fmaxf(zmax, zat(r));
+        }
+    }
+    static constexpr const char* glsl = "(zs)*(sin((fr)*(r))/(r))";
+    static constexpr const char* glslDz = "(zs)*((fr)*(r)*cos((fr)*(r)) - sin((fr)*(r)))/((r)*(r))";
+};
+
+// zscale exp(-freq r^2/8): a single bump, monotone in r
+struct Gaussian {
+    static float z(float rr, float zscale, float freq){ return zscale * expf(-freq*rr*0.125f); }
+    static void range(double rmin, double rmax, float zscale, float freq, float& zmin, float& zmax){
+        const float a = z(float(rmin*rmin), zscale, freq), b = z(float(rmax*rmax), zscale, freq);
+        zmin = fminf(a, b); zmax = fmaxf(a, b);
     }
+    static constexpr const char* glsl = "(zs)*exp(-(fr)*(r)*(r)*0.125)";
+    static constexpr const char* glslDz = "(-0.25*(zs)*(fr)*(r)*exp(-(fr)*(r)*(r)*0.125))";
+};
 
-    // indices (GLushort, two tris per cell)
-    std::vector<GLushort> idx; idx.reserve((N-1)*(N-1)*6);
-    for (int j=0;j<N-1;++j){
-        for (int i=0;i<N-1;++i){
-            GLushort a = j*N + i;
-            GLushort b = j*N + (i+1);
-            GLushort c = (j+1)*N + i;
-            GLushort d = (j+1)*N + (i+1);
-            idx.push_back(a); idx.push_back(c); idx.push_back(b);
-            idx.push_back(b); idx.push_back(c); idx.push_back(d);
+// zscale cos(freq r) e^(-r/4): rings that fade outwards
+struct Ripple {
+    static constexpr float DECAY = 0.25f;
+    static float z(float rr, float zscale, float freq){
+        const float r = sqrtf(rr);
+        return zscale * cosf(freq*r) * expf(-DECAY*r);
+    }
+    // both ends plus the extrema, where tan(f r) = -DECAY/f
+    static void range(double rmin, double rmax, float zscale, float freq, float& zmin, float& zmax){
+        auto zat = [&](double r){ return float(zscale*cos(freq*r)*exp(-DECAY*r)); };
+        zmin = fminf(zat(rmin), zat(rmax));
+        zmax = fmaxf(zat(rmin), zat(rmax));
+        const double f = fabs(freq);
+        if (f <= 0.0) return;
+        for (int k=1;; ++k){
+            const double r = (k*M_PI - atan(DECAY/f))/f;
+            if (r >= rmax) break;
+            if (r <= rmin) continue;
+            zmin = fminf(zmin, zat(r));
+            zmax = fmaxf(zmax, zat(r));
         }
     }
+    static constexpr const char* glsl = "(zs)*cos((fr)*(r))*exp(-0.25*(r))";
+    static constexpr const char* glslDz = "(-(zs)*exp(-0.25*(r))*((fr)*sin((fr)*(r)) + 0.25*cos((fr)*(r))))";
+};
 
-    Mesh m{};
-    glGenBuffers(1,&m.vbo); glBindBuffer(GL_ARRAY_BUFFER,m.vbo);
-    glBufferData(GL_ARRAY_BUFFER, pos.size()*sizeof(float), pos.data(), GL_STATIC_DRAW);
-    glGenBuffers(1,&m.cbo); glBindBuffer(GL_ARRAY_BUFFER,m.cbo);
-    glBufferData(GL_ARRAY_BUFFER, col.size()*sizeof(float), col.data(), GL_STATIC_DRAW);
-    glGenBuffers(1,&m.ibo); glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,m.ibo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx.size()*sizeof(GLushort), idx.data(), GL_STATIC_DRAW);
-    m.indexCount = (GLsizei)idx.size();
-    return m;
+// one row of z for surface S; S::z inlines, so there is no call per vertex
+template<class S>
+static void surfaceRow(const float* xx, float yy, float zscale, float freq, int n, float* z){
+    for (int k=0;k<n;++k) z[k] = S::z(xx[k] + yy, zscale, freq);
 }
 
-int main(int argc, char** argv){
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-        fprintf(stderr,"SDL_Init: %s\n", SDL_GetError()); return 1;
+struct SurfaceDef {
+    const char* name;
+    RowKernel row;
+    void (*range)(double rmin, double rmax, float zscale, float freq, float& zmin, float& zmax);
+    const char* glsl;       // body of SURFACE_Z(r, zs, fr) in the vertex shader
+    const char* glslDz;     // body of SURFACE_DZ(r, zs, fr) in the fragment shader
+};
+template<class S>
+static constexpr SurfaceDef surfaceDef(const char* name){ return SurfaceDef{ name, surfaceRow<S>, S::range, S::glsl, S::glslDz }; }
+static const SurfaceDef SURFACES[] = {
+    surfaceDef<Sombrero>("sombrero"),
+    surfaceDef<Gaussian>("gaussian"),
+    surfaceDef<Ripple>("ripple"),
+};
+static const int SURFACE_COUNT = int(sizeof SURFACES / sizeof SURFACES[0]);
+static const SurfaceDef* currentSurface = &SURFACES[0];   // --surface
+
+static void radialRange(double rmin, double rmax, float zscale, float freq, float& zmin, float& zmax){
+    currentSurface->range(rmin, rmax, zscale, freq, zmin, zmax);
+}
+// over the grid, from its nearest and farthest vertex radii
+static void surfaceRange(int N, float radius, float zscale, float freq, float& zmin, float& zmax){
+    const double h = (N&1) ? 0.0 : radius/(N-1);   // half a step for even N
+    radialRange(fmax(sqrt(2.0*h*h), 1e-4), radius*sqrt(2.0), zscale, freq, zmin, zmax);
+}
+
+// z bounds of every tile for the mesh's current zscale/freq
+static void tileBounds(Mesh& m){
+    for (GridTile& t : m.tiles) radialRange(t.rmin, t.rmax, m.zscale, m.freq, t.zmin, t.zmax);
+}
+
+// m.tiles from the ranges of a TOPO_TILED grid, in the order
+// writeGridIndices laid them out
+static void layoutTiles(Mesh& m){
+    m.tiles.clear();
+    const int N = m.N;
+    auto coord = [&](int i){ return -m.radius + float(i)/(N-1)*(2.0f*m.radius); };
+    for (size_t b=0; b<m.ranges.size(); ++b){
+        const DrawRange& dr = m.ranges[b];
+        const int row0 = dr.baseVertex / N, rows = dr.count / (6*(N-1)) + 1;
+        GLsizei first = dr.first;
+        forTiles(N, rows, [&](int i0, int i1, int j0, int j1){
+            GridTile t;
+            t.range = int(b);
+            t.first = first; t.count = GLsizei(6*(i1-i0)*(j1-j0));
+            first += t.count;
+            const float xa = coord(i0), xb = coord(i1), ya = coord(row0+j0), yb = coord(row0+j1);
+            const float s = 1.5f/m.radius;
+            t.x0 = xa*s; t.x1 = xb*s; t.y0 = ya*s; t.y1 = yb*s;
+            // nearest point of the box to the axis, and its farthest corner
+            const float nx = (xa > 0) ? xa : (xb < 0) ? xb : 0.0f;
+            const float ny = (ya > 0) ? ya : (yb < 0) ? yb : 0.0f;
+            t.rmin = fmaxf(sqrtf(nx*nx + ny*ny), 1e-4f);
+            t.rmax = sqrtf(fmaxf(xa*xa, xb*xb) + fmaxf(ya*ya, yb*yb));
+            m.tiles.push_back(t);
+        });
     }
+    tileBounds(m);
+}
 
-    // Request GLES 2.0 context
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
-    SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+static int clampGridSize(int N){
+    if (N<3) N=3;
+    // 16-bit bands need at least two vertex rows of at most 65,535 vertices
+    if (!caps.uintIndex && N>32767) {
+        fprintf(stderr,"N=%d needs OES_element_index_uint; clamping to 32767\n", N);
+        N=32767;
+    }
+    return N;
+}
 
-    SDL_Window* win = SDL_CreateWindow(
-        "Spinning Sombrero (SDL2 + GLES2)",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        900, 700, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
-    if (!win){ fprintf(stderr,"SDL_CreateWindow: %s\n", SDL_GetError()); return 1; }
+// indices: one 32-bit range, or 16-bit row bands sharing their edge row; a
+// grid that fits 16 bits uses a single 16-bit range even when 32-bit indices
+// are available. The ranges are laid out first so the exact size is known
+// before filling.
+static void uploadGridIndices(Mesh& m, int N, Topology topo){
+    const bool wide = caps.uintIndex && size_t(N)*N > 65536;
+    m.prim = (topo == TOPO_STRIP) ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+    m.indexType = wide ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    const int bandRows = (wide || size_t(N)*N <= 65536) ? N : 65535 / N;
+    std::vector<int> bandSize;
+    size_t total = 0;
+    for (int j0=0; j0<N-1; j0+=bandRows-1){
+        const int rows = (j0+bandRows > N) ? N-j0 : bandRows;
+        DrawRange dr;
+        dr.first = (GLsizei)total;
+        dr.count = (GLsizei)gridIndexCount(N, rows, topo);
+        dr.baseVertex = j0*N;
+        m.ranges.push_back(dr);
+        bandSize.push_back(rows);
+        total += dr.count;
+        m.triangles += size_t(N-1)*(rows-1)*2;
+    }
+    m.indexCount = (GLsizei)total;
+    if (topo == TOPO_TILED) layoutTiles(m);
 
-    SDL_GLContext ctx = SDL_GL_CreateContext(win);
-    if (!ctx){ fprintf(stderr,"SDL_GL_CreateContext: %s\n", SDL_GetError()); return 1; }
-    SDL_GL_SetSwapInterval(1);
+    const size_t isz = wide ? sizeof(GLuint) : sizeof(GLushort);
+    const GLushort* embedded = wide ? nullptr : embeddedIndices(N, topo);
+    uploadBuffer(m.ibo, GL_ELEMENT_ARRAY_BUFFER, total*isz, GL_STATIC_DRAW, [&](void* p){
+        if (embedded) { memcpy(p, embedded, total*isz); return; }
+        for (size_t b=0; b<m.ranges.size(); ++b){
+            if (wide) writeGridIndices((GLuint*)p + m.ranges[b].first, N, bandSize[b], topo);
+            else      writeGridIndices((GLushort*)p + m.ranges[b].first, N, bandSize[b], topo);
+        }
+    });
+}
 
-    GLuint prog = linkProgram(VS_SRC, FS_SRC);
-    GLint locPos = 0; // bound via glBindAttribLocation
-    GLint locCol = 1;
-    GLint locMVP = glGetUniformLocation(prog, "uMVP");
+// Ring layout matching the worst-case error of an N grid. Linear interpolation
+// across a step h misses by h^2 |z''|/8, so rings are spaced by
+// sqrt(8e/|z''|) with e the grid's error at the centre, where |z''| peaks at
+// zscale*freq^3/3. Along a ring z is constant and only the chord's sagitta,
+// r(pi/n)^2/2 times |z'|, is lost, so n = pi*sqrt(r|z'|/2e). Both derivatives
+// use their envelope so zero crossings of the ripples do not open gaps.
+//
+// Rings run out to the square's corners and are pulled onto the edge along
+// their ray. A ring beyond the edge would repeat the clamped points of the
+// ring inside it, so it only owns the new part of the edge and borrows the
+// rest when the indices are built (nextRingLoop). Edge points are spaced by
+// the same rule as the rings, at most 2R dth apart near the corners.
+static const double RADIAL_QUARTER = M_PI/2;
 
-    Mesh mesh = makeSombrero(128, 6.0f, 1.0f, 1.0f);
+// angle from th to the nearest edge normal
+static double radialEdgeOffset(double th){
+    return fabs(fmod(th + RADIAL_QUARTER/2, RADIAL_QUARTER) - RADIAL_QUARTER/2);
+}
 
-    int w=900,h=700;
-    glViewport(0,0,w,h);
-    glEnable(GL_DEPTH_TEST);
+// calls fn(th) for each vertex the ring owns, in angle order
+template<class F>
+static void forRingAngles(const RadialRing& g, F&& fn){
+    int i=0, j=0;
+    while (i < g.arcSeg || j < g.edgeSeg){
+        const double ta = (i < g.arcSeg) ? 2.0*M_PI*i/g.arcSeg : 4.0*M_PI;
+        const double te = (j < g.edgeSeg) ? 2.0*M_PI*j/g.edgeSeg : 4.0*M_PI;
+        if (ta <= te) { ++i; if (radialEdgeOffset(ta) >= g.arc) fn(ta); }
+        else {
+            ++j;
+            const double d = radialEdgeOffset(te);
+            if (d >= g.innerArc && d < g.arc) fn(te);
+        }
+    }
+}
 
-    bool quit=false;
-    float ang=0.0f;
-
-    while(!quit){
-        SDL_Event e;
-        while(SDL_PollEvent(&e)){
-            if (e.type==SDL_QUIT) quit=true;
-            if (e.type==SDL_WINDOWEVENT && e.window.event==SDL_WINDOWEVENT_SIZE_CHANGED){
-                w=e.window.data1; h=e.window.data2;
-                glViewport(0,0,w,h);
+// returns the vertex count
+static size_t radialRings(int N, float radius, float zscale, float freq, std::vector<RadialRing>& rings){
+    const double a = fabs(zscale), f = fmax(fabs(freq), 1e-3);
+    const double h = 2.0*radius/(N-1);
+    const double c0 = a*f*f*f/3.0;
+    const double e = fmax(h*h*c0/8.0, 1e-12);
+    auto curv = [&](double r){ return fmin(c0, a*(f*f/r + 2.0*f/(r*r) + 2.0/(r*r*r))); };
+    auto slope = [&](double r){ return fmin(c0*r, a*(f/r + 1.0/(r*r))); };
+    auto roundUp8 = [](double n){ int k = int(ceil(n/8.0))*8; return k < 8 ? 8 : k; };
+
+    // rings at equal steps of u(r) = integral of 1/spacing
+    const double rmax = radius*sqrt(2.0);
+    const int SAMPLES = 4096;
+    std::vector<double> u(SAMPLES+1, 0.0);
+    for (int k=1;k<=SAMPLES;++k){
+        const double r = rmax*(k-0.5)/SAMPLES;
+        u[k] = u[k-1] + (rmax/SAMPLES) / sqrt(8.0*e/curv(r));
+    }
+    const int count = int(ceil(u[SAMPLES])) > 2 ? int(ceil(u[SAMPLES])) : 2;
+    rings.assign(1, RadialRing());
+    size_t vertices = 1;
+    int s = 0;
+    for (int k=1;k<=count;++k){
+        const double target = u[SAMPLES]*k/count;
+        while (s < SAMPLES && u[s+1] < target) ++s;
+        const double t = (u[s+1] > u[s]) ? (target-u[s])/(u[s+1]-u[s]) : 1.0;
+        const double r = (k == count) ? rmax : rmax*(s+t)/SAMPLES;
+        RadialRing g;
+        g.r = float(r);
+        g.innerArc = rings.back().arc;
+        g.arc = (r > radius) ? acos(radius/r) : 0.0;
+        g.arcSeg = roundUp8(M_PI*sqrt(r*slope(r)/(2.0*e)));
+        g.edgeSeg = (g.arc > 0.0) ? roundUp8(4.0*M_PI*radius / sqrt(8.0*e/curv(r))) : 0;
+        g.first = int(vertices);
+        forRingAngles(g, [&](double){ ++vertices; });
+        rings.push_back(g);
+    }
+    return vertices;
+}
+
+// z for one run of a grid row from squared coordinates: z[k] is
+// zscale*sin(freq*r)/r with r = sqrt(xx[k] + yy). A kernel gives the same
+// bits for the same (xx[k], yy) wherever k falls in the run, and xx+yy is
+// symmetric, which is what lets evalSombrero mirror z across the grid.
+// reference kernel, the exact expression of the original loop
+static const RowKernel sombreroRowScalar = surfaceRow<Sombrero>;
+
+// Polynomial sine shared by the vector kernels: reduce by the nearest multiple
+// of pi (three-part Cody-Waite), flip the sign for odd multiples, then the
+// odd Taylor series to r^11 on [-pi/2, pi/2]. Absolute error stays below
+// 3e-7 for |x| < 1e4 and is relative near 0, so sin(f*r)/r keeps its
+// precision at the centre of the grid.
+static const float SIN_INV_PI = 0.318309886183790671f;
+static const float SIN_PI_A = 3.140625f;
+static const float SIN_PI_B = 9.67502593994140625e-4f;
+static const float SIN_PI_C = 1.509957990978376432e-7f;
+static const float SIN_C3 = -1.66666667e-1f, SIN_C5 = 8.33333333e-3f, SIN_C7 = -1.98412698e-4f;
+static const float SIN_C9 = 2.75573192e-6f, SIN_C11 = -2.50521084e-8f;
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static inline __m256 sin8(__m256 x){
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(SIN_INV_PI)),
+                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(SIN_PI_A), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(SIN_PI_B), r);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(SIN_PI_C), r);
+    __m256 sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtps_epi32(k), 31));
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 p = _mm256_fmadd_ps(r2, _mm256_set1_ps(SIN_C11), _mm256_set1_ps(SIN_C9));
+    p = _mm256_fmadd_ps(r2, p, _mm256_set1_ps(SIN_C7));
+    p = _mm256_fmadd_ps(r2, p, _mm256_set1_ps(SIN_C5));
+    p = _mm256_fmadd_ps(r2, p, _mm256_set1_ps(SIN_C3));
+    __m256 s = _mm256_fmadd_ps(_mm256_mul_ps(r, r2), p, r);
+    return _mm256_xor_ps(s, sign);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 sombrero8(__m256 xx, __m256 yy, __m256 zscale, __m256 freq){
+    __m256 r = _mm256_max_ps(_mm256_sqrt_ps(_mm256_add_ps(xx, yy)), _mm256_set1_ps(1e-4f));
+    return _mm256_mul_ps(zscale, _mm256_div_ps(sin8(_mm256_mul_ps(freq, r)), r));
+}
+
+__attribute__((target("avx2,fma")))
+static void sombreroRowAVX2(const float* xx, float yy, float zscale, float freq, int n, float* z){
+    const __m256 vyy = _mm256_set1_ps(yy);
+    const __m256 vzscale = _mm256_set1_ps(zscale), vfreq = _mm256_set1_ps(freq);
+    int k=0;
+    for (; k+8<=n; k+=8)
+        _mm256_storeu_ps(z+k, sombrero8(_mm256_loadu_ps(xx+k), vyy, vzscale, vfreq));
+    if (k < n) {
+        // the tail goes through the same lanes so its bits match a full block
+        float xt[8] = {}, zt[8];
+        memcpy(xt, xx+k, size_t(n-k)*sizeof(float));
+        _mm256_storeu_ps(zt, sombrero8(_mm256_loadu_ps(xt), vyy, vzscale, vfreq));
+        memcpy(z+k, zt, size_t(n-k)*sizeof(float));
+    }
+}
+#endif
+
+#if defined(__aarch64__)
+static inline float32x4_t sin4(float32x4_t x){
+    float32x4_t k = vrndnq_f32(vmulq_f32(x, vdupq_n_f32(SIN_INV_PI)));
+    float32x4_t r = vfmsq_f32(x, k, vdupq_n_f32(SIN_PI_A));
+    r = vfmsq_f32(r, k, vdupq_n_f32(SIN_PI_B));
+    r = vfmsq_f32(r, k, vdupq_n_f32(SIN_PI_C));
+    uint32x4_t sign = vshlq_n_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(k)), 31);
+    float32x4_t r2 = vmulq_f32(r, r);
+    float32x4_t p = vfmaq_f32(vdupq_n_f32(SIN_C9), r2, vdupq_n_f32(SIN_C11));
+    p = vfmaq_f32(vdupq_n_f32(SIN_C7), r2, p);
+    p = vfmaq_f32(vdupq_n_f32(SIN_C5), r2, p);
+    p = vfmaq_f32(vdupq_n_f32(SIN_C3), r2, p);
+    float32x4_t s = vfmaq_f32(r, vmulq_f32(r, r2), p);
+    return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(s), sign));
+}
+
+static inline float32x4_t sombrero4(float32x4_t xx, float32x4_t yy, float32x4_t zscale, float32x4_t freq){
+    float32x4_t r = vmaxq_f32(vsqrtq_f32(vaddq_f32(xx, yy)), vdupq_n_f32(1e-4f));
+    return vmulq_f32(zscale, vdivq_f32(sin4(vmulq_f32(freq, r)), r));
+}
+
+static void sombreroRowNEON(const float* xx, float yy, float zscale, float freq, int n, float* z){
+    const float32x4_t vyy = vdupq_n_f32(yy);
+    const float32x4_t vzscale = vdupq_n_f32(zscale), vfreq = vdupq_n_f32(freq);
+    int k=0;
+    for (; k+4<=n; k+=4)
+        vst1q_f32(z+k, sombrero4(vld1q_f32(xx+k), vyy, vzscale, vfreq));
+    if (k < n) {
+        float xt[4] = {}, zt[4];
+        memcpy(xt, xx+k, size_t(n-k)*sizeof(float));
+        vst1q_f32(zt, sombrero4(vld1q_f32(xt), vyy, vzscale, vfreq));
+        memcpy(z+k, zt, size_t(n-k)*sizeof(float));
+    }
+}
+#endif
+
+static RowKernel rowKernel = sombreroRowScalar;
+static const char* rowKernelName = "scalar";
+
+// best vector kernel this CPU runs, or the scalar reference
+// the vector kernels are the sombrero's; other surfaces run their scalar row
+static void selectRowKernel(bool simd){
+    rowKernel = currentSurface->row; rowKernelName = "scalar";
+    if (!simd || rowKernel != sombreroRowScalar) return;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        rowKernel = sombreroRowAVX2; rowKernelName = "avx2";
+    }
+#elif defined(__aarch64__)
+#if defined(__linux__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_ASIMD)) return;
+#endif
+    rowKernel = sombreroRowNEON; rowKernelName = "neon";
+#endif
+}
+
+static void heightColour(float t, GLubyte* c){
+    float r,g,b;
+    if (t < 0.25f) { float k=t/0.25f; r=0.0f; g=k;   b=1.0f; }
+    else if (t < 0.50f) { float k=(t-0.25f)/0.25f; r=0.0f; g=1.0f; b=1.0f-k; }
+    else if (t < 0.75f) { float k=(t-0.50f)/0.25f; r=k;   g=1.0f; b=0.0f; }
+    else { float k=(t-0.75f)/0.25f; r=1.0f; g=1.0f-k; b=0.0f; }
+    c[0]=GLubyte(r*255.0f+0.5f); c[1]=GLubyte(g*255.0f+0.5f); c[2]=GLubyte(b*255.0f+0.5f); c[3]=255;
+}
+template<class Vtx>
+static void setColour(Vtx& v, float t){ heightColour(t, v.col); }
+static void setColour(VertexPos&, float){}
+static void setColour(VertexHalfPos&, float){}
+
+// grid coordinates and their squares; x_i and y_i share one expression, so
+// one table serves both axes
+struct GridScratch {
+    std::vector<float> coord, sq;
+    std::vector<int> slot;          // index -> entry in uniqueSq
+    std::vector<float> uniqueSq;    // distinct squares, in index order
+    std::vector<float> z;           // M x M table of z by slot pair
+};
+static thread_local GridScratch gridScratch;   // reused by every CPU grid evaluation
+// the table only pays when an evaluation costs more than reading it back:
+// with libm sinf, not with the vector kernels at ~1 ns per vertex
+static bool mirrorEval = true;
+// largest octant table, in floats, before falling back to every vertex
+static const size_t MIRROR_MAX_TABLE = size_t(1)<<24;
+
+static void gridCoords(int N, float radius, GridScratch& g){
+    const float xmin=-radius, xmax=radius;
+    g.coord.resize(N); g.sq.resize(N);
+    for (int i=0;i<N;++i){
+        float t = float(i)/(N-1);
+        g.coord[i] = xmin + t*(xmax-xmin);
+        g.sq[i] = g.coord[i]*g.coord[i];
+    }
+}
+
+// z over one octant of the grid. Indices i and N-1-i share a slot when their
+// coordinates square to the same float, and z(i,j) = z(j,i) because the
+// kernels add xx+yy, so every vertex gets the same bits from M(M+1)/2
+// evaluations for M distinct squares. Rounding in the coordinate expression
+// breaks about half the mirror pairs, so M is ~0.75N rather than N/2: a
+// quarter to a third of the N^2 evaluations. The lower triangle is evaluated
+// and copied across the diagonal so each grid row reads one table row.
+// Returns null if it would not pay.
+static const float* octantZ(int N, float zscale, float freq, GridScratch& g){
+    g.slot.resize(N); g.uniqueSq.clear();
+    for (int i=0;i<N;++i){
+        const int m = N-1-i;
+        if (m < i && g.sq[m] == g.sq[i]) g.slot[i] = g.slot[m];
+        else { g.slot[i] = int(g.uniqueSq.size()); g.uniqueSq.push_back(g.sq[i]); }
+    }
+    const size_t M = g.uniqueSq.size();
+    if (M*(M+1)/2 > size_t(N)*N/2 || M*M > MIRROR_MAX_TABLE) return nullptr;
+    g.z.resize(M*M);
+    float* z = g.z.data();
+    workerPool().parallelFor(int(M), [&](int s0, int s1){
+        for (int s=s0;s<s1;++s)
+            rowKernel(g.uniqueSq.data(), g.uniqueSq[s], zscale, freq, s+1, z + size_t(s)*M);
+    });
+    // upper triangle in TILE x TILE blocks so the column reads stay cached
+    const int TILE = 32;
+    const int tiles = int((M + TILE-1)/TILE);
+    workerPool().parallelFor(tiles, [&](int b0, int b1){
+        for (int bt=b0; bt<b1; ++bt)
+            for (int bs=bt; bs<tiles; ++bs)
+                for (size_t s=size_t(bs)*TILE; s<std::min(M, size_t(bs+1)*TILE); ++s)
+                    for (size_t t=size_t(bt)*TILE; t<std::min(s, size_t(bt+1)*TILE); ++t)
+                        z[t*M + s] = z[s*M + t];
+    });
+    return z;
+}
+
+// CPU surface into a pre-sized interleaved array in a single pass: the
+// z-range comes from surfaceRange, so each vertex is coloured as soon as its
+// z is known. z is looked up in the octant table, or with --full-eval taken
+// from rowKernel in runs of ROW_RUN. Rows are split across the worker pool.
+template<class Vtx>
+static void evalSombrero(int N, float radius, float zscale, float freq,
+                         float zmin, float zmax, Vtx* out) {
+    float range = (zmax - zmin); if (range < 1e-6f) range = 1.0f;
+    GridScratch& g = gridScratch;
+    gridCoords(N, radius, g);
+    const float* octant = (mirrorEval && rowKernel == currentSurface->row) ? octantZ(N, zscale, freq, g) : nullptr;
+
+    const int ROW_RUN = 256;
+    workerPool().parallelFor(N, [&](int j0, int j1){
+        float zrun[ROW_RUN];
+        Vtx* p = out + size_t(j0)*N;
+        for (int j=j0;j<j1;++j){
+            const float y = g.coord[j];
+            for (int i0=0;i0<N;i0+=ROW_RUN){
+                const int n = (N-i0 < ROW_RUN) ? N-i0 : ROW_RUN;
+                if (octant) {
+                    const float* row = octant + size_t(g.slot[j])*g.uniqueSq.size();
+                    for (int k=0;k<n;++k) zrun[k] = row[g.slot[i0+k]];
+                }
+                else rowKernel(&g.sq[i0], g.sq[j], zscale, freq, n, zrun);
+                for (int k=0;k<n;++k){
+                    float x = g.coord[i0+k];
+                    float z = zrun[k];
+                    float t = (z-zmin)/range;
+                    setPos(*p, (x/radius)*1.5f, (y/radius)*1.5f, z);
+                    setColour(*p, t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t);
+                    ++p;
+                }
+            }
+        }
+    });
+}
+
+// radial counterpart of evalSombrero, over the vertices each ring owns
+template<class Vtx>
+static void evalRadial(const Mesh& m, Vtx* out){
+    float range = (m.zmax - m.zmin); if (range < 1e-6f) range = 1.0f;
+    workerPool().parallelFor(int(m.rings.size()), [&](int k0, int k1){
+        for (int k=k0;k<k1;++k){
+            const RadialRing& g = m.rings[k];
+            Vtx* p = out + g.first;
+            forRingAngles(g, [&](double th){
+                float x = g.r*float(cos(th)), y = g.r*float(sin(th));
+                const float c = fmaxf(fabsf(x), fabsf(y));
+                if (c > m.radius) { x *= m.radius/c; y *= m.radius/c; }
+                float r = sqrtf(x*x + y*y);
+                if (r < 1e-4f) r = 1e-4f;
+                const float z = m.zscale * (sinf(m.freq*r)/r);
+                const float t = (z-m.zmin)/range;
+                setPos(*p, (x/m.radius)*1.5f, (y/m.radius)*1.5f, z);
+                setColour(*p, t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t);
+                ++p;
+            });
+        }
+    });
+}
+
+static void evalSombrero(const Mesh& m, void* out){
+    auto eval = [&](auto* v){
+        if (!m.rings.empty()) evalRadial(m, v);
+        else evalSombrero(m.N, m.radius, m.zscale, m.freq, m.zmin, m.zmax, v);
+    };
+    if (m.lut) { if (m.halfPos) eval((VertexHalfPos*)out); else eval((VertexPos*)out); }
+    else       { if (m.halfPos) eval((VertexHalf*)out);    else eval((Vertex*)out); }
+}
+static size_t vertexSize(const Mesh& m){
+    if (m.gpuEval) return 2*sizeof(GLushort);
+    if (m.lut) return m.halfPos ? sizeof(VertexHalfPos) : sizeof(VertexPos);
+    return m.halfPos ? sizeof(VertexHalf) : sizeof(Vertex);
+}
+
+// vertices are generated straight into the mapped VBO when OES_mapbuffer is
+// there, so a static mesh never holds a host copy of its vertex data
+static Mesh makeSombrero(int N=128, float radius=6.0f, float zscale=1.0f, float freq=1.0f,
+                         const MeshOptions& opt=MeshOptions()) {
+    Mesh m{};
+    m.N = N = clampGridSize(N);
+    m.radius=radius; m.zscale=zscale; m.freq=freq;
+    m.halfPos = opt.halfPos && caps.halfFloat;
+    m.lut = opt.lut;
+    m.dynamic = opt.dynamic;
+    surfaceRange(N, radius, zscale, freq, m.zmin, m.zmax);
+
+    m.vertices = size_t(N)*N;
+    uploadBuffer(m.vbo, GL_ARRAY_BUFFER, m.vertices*vertexSize(m), m.dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW,
+               [&](void* p){ evalSombrero(m, p); }, m.dynamic ? &m.host : nullptr);
+    uploadGridIndices(m, N, opt.topology);
+    return m;
+}
+
+// One ring as seen by the index builder: its owned vertices plus the clamped
+// ones it borrows from the ring inside, in angle order.
+struct RingLoop {
+    std::vector<double> angle;
+    std::vector<GLuint> index;
+};
+static void nextRingLoop(const RadialRing& g, const RingLoop& inner, RingLoop& out){
+    out.angle.clear(); out.index.clear();
+    GLuint v = GLuint(g.first);
+    size_t b = 0;
+    // inner vertices on the part of the edge this ring does not own
+    auto borrowUpTo = [&](double th){
+        for (; b<inner.angle.size() && inner.angle[b] < th; ++b)
+            if (radialEdgeOffset(inner.angle[b]) < g.innerArc) {
+                out.angle.push_back(inner.angle[b]); out.index.push_back(inner.index[b]);
             }
+    };
+    forRingAngles(g, [&](double th){
+        borrowUpTo(th);
+        out.angle.push_back(th); out.index.push_back(v++);
+    });
+    borrowUpTo(4.0*M_PI);
+}
+// zips two closed loops by angle; triangles on a shared vertex pair vanish.
+// They wind clockwise seen from +z, like the grid's, for LIT's gl_FrontFacing.
+static void zipRingLoops(const RingLoop& a, const RingLoop& b, std::vector<GLuint>& tris){
+    const size_t na = a.index.size(), nb = b.index.size();
+    size_t i=0, j=0;
+    while (i<na || j<nb){
+        const double nextA = (i+1<na) ? a.angle[i+1] : 2.0*M_PI + a.angle[0];
+        const double nextB = (j+1<nb) ? b.angle[j+1] : 2.0*M_PI + b.angle[0];
+        const bool stepB = (na == 1) || i == na || (j<nb && nextB <= nextA);
+        const GLuint p = a.index[i%na], q = b.index[j%nb];
+        const GLuint r = stepB ? b.index[(j+1)%nb] : a.index[(i+1)%na];
+        if (p != q && q != r && r != p) { tris.push_back(p); tris.push_back(r); tris.push_back(q); }
+        if (stepB) ++j; else ++i;
+        if (na == 1 && j == nb) break;
+    }
+}
+
+// Adaptive polar mesh with the worst-case error of an N grid (radialRings),
+// drawn as a triangle list; without 32-bit indices it is split into ranges
+// of rings, rebased like the grid's row bands.
+static Mesh makeSombreroRadial(int N=128, float radius=6.0f, float zscale=1.0f, float freq=1.0f,
+                               const MeshOptions& opt=MeshOptions()) {
+    Mesh m{};
+    m.N = N = clampGridSize(N);
+    m.radius=radius; m.zscale=zscale; m.freq=freq;
+    m.halfPos = opt.halfPos && caps.halfFloat;
+    m.lut = opt.lut;
+    m.dynamic = opt.dynamic;
+    m.vertices = radialRings(N, radius, zscale, freq, m.rings);
+    // one odd N: the centre vertex sits at r=0
+    surfaceRange(1, radius, zscale, freq, m.zmin, m.zmax);
+
+    uploadBuffer(m.vbo, GL_ARRAY_BUFFER, m.vertices*vertexSize(m), m.dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW,
+               [&](void* p){ evalSombrero(m, p); }, m.dynamic ? &m.host : nullptr);
+
+    // the indices are built once in 32 bits, then cut into ranges whose
+    // vertices span less than 65,536 when they have to fit 16 bits
+    std::vector<GLuint> tris;
+    std::vector<size_t> ringTris(1, 0);
+    RingLoop inner, outer;
+    nextRingLoop(m.rings[0], RingLoop(), inner);
+    for (size_t k=1;k<m.rings.size();++k){
+        nextRingLoop(m.rings[k], inner, outer);
+        zipRingLoops(inner, outer, tris);
+        ringTris.push_back(tris.size());
+        std::swap(inner, outer);
+    }
+    m.prim = GL_TRIANGLES;
+    m.indexType = caps.uintIndex ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    m.indexCount = (GLsizei)tris.size();
+    m.triangles = tris.size()/3;
+    for (size_t k=1, first=0; k<ringTris.size(); ){
+        GLuint lo = ~0u, hi = 0;
+        size_t end = first;
+        for (; k<ringTris.size(); ++k){
+            GLuint l = lo, h = hi;
+            for (size_t t=ringTris[k-1]; t<ringTris[k]; ++t){ l = std::min(l, tris[t]); h = std::max(h, tris[t]); }
+            if (!caps.uintIndex && end > first && h-l > 65535) break;
+            lo = l; hi = h; end = ringTris[k];
         }
+        DrawRange dr;
+        dr.first = (GLsizei)first;
+        dr.count = (GLsizei)(end-first);
+        dr.baseVertex = caps.uintIndex ? 0 : (GLsizei)lo;
+        m.ranges.push_back(dr);
+        first = end;
+    }
+
+    const size_t isz = caps.uintIndex ? sizeof(GLuint) : sizeof(GLushort);
+    uploadBuffer(m.ibo, GL_ELEMENT_ARRAY_BUFFER, tris.size()*isz, GL_STATIC_DRAW, [&](void* p){
+        if (caps.uintIndex) { memcpy(p, tris.data(), tris.size()*sizeof(GLuint)); return; }
+        for (const DrawRange& dr : m.ranges)
+            for (GLsizei t=dr.first; t<dr.first+dr.count; ++t)
+                ((GLushort*)p)[t] = GLushort(tris[t] - GLuint(dr.baseVertex));
+    });
+    return m;
+}
+
+// GPU_EVAL mesh: only the (i,j) index of each vertex is uploaded; the vertex
+// shader derives x, y, z and colour from it and the uniforms set in drawMesh
+static Mesh makeSombreroGrid(int N=128, float radius=6.0f, float zscale=1.0f, float freq=1.0f,
+                             const MeshOptions& opt=MeshOptions()) {
+    Mesh m{};
+    m.gpuEval=true;
+    const int n = clampGridSize(N);
+    m.N = N = n > 65536 ? 65536 : n;   // index must fit a GLushort
+    m.radius=radius; m.zscale=zscale; m.freq=freq;
+    m.vertices = size_t(N)*N;
+    surfaceRange(N, radius, zscale, freq, m.zmin, m.zmax);
 
-        glClearColor(0.02f,0.02f,0.03f,1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    uploadBuffer(m.vbo, GL_ARRAY_BUFFER, size_t(N)*N*2*sizeof(GLushort), GL_STATIC_DRAW, [&](void* out){
+        workerPool().parallelFor(N, [&](int j0, int j1){
+            GLushort* p = (GLushort*)out + size_t(j0)*N*2;
+            for (int j=j0;j<j1;++j)
+                for (int i=0;i<N;++i){ *p++ = GLushort(i); *p++ = GLushort(j); }
+        });
+    });
+    uploadGridIndices(m, N, opt.topology);
+    return m;
+}
 
-        float aspect = (h>0) ? (float)w/(float)h : 1.0f;
-        Mat4 P = perspective(60.0f*(3.1415926f/180.0f), aspect, 0.1f, 50.0f);
-        Mat4 V = translate(0.0f, 0.0f, -4.5f);
-        Mat4 R = mul(rotateY(ang*0.9f), rotateX(ang*0.5f));
-        Mat4 MVP = mul(P, mul(V, R));
+// new zscale/freq without creating GL objects: GPU_EVAL meshes only change
+// uniforms; dynamic CPU meshes are re-evaluated into an orphaned mapping of
+// the same buffer, or into their reused staging copy
+static void updateSombrero(Mesh& m, float zscale, float freq){
+    m.zscale=zscale; m.freq=freq;
+    surfaceRange(m.rings.empty() ? m.N : 1, m.radius, zscale, freq, m.zmin, m.zmax);
+    tileBounds(m);
+    if (m.gpuEval || !m.dynamic) return;   // static CPU mesh: rebuild instead
+    bindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    fillBuffer(GL_ARRAY_BUFFER, m.vertices*vertexSize(m), GL_DYNAMIC_DRAW,
+               [&](void* p){ evalSombrero(m, p); }, &m.host);
+}
 
-        glUseProgram(prog);
-        glUniformMatrix4fv(locMVP, 1, GL_FALSE, MVP.m);
+// Per-instance attributes of the INSTANCED program: K copies of one
+// GPU_EVAL grid tiled over the single surface's +-1.5 footprint, each with
+// its own zscale/freq.
+// the instance buffer has the same layout with model replaced by the MVP,
+// rebuilt from the camera every frame by uploadInstanceMVPs
+struct Instance {
+    float model[16];
+    float surface[4];       // as uSurface: zscale, freq, zmin, 1/(zmax-zmin)
+};
+struct InstanceSet {
+    GLuint vbo=0;
+    std::vector<Instance> host;
+    std::vector<Instance> frame;    // without instancing: this frame's MVPs
+};
+static const GLuint INSTANCE_ATTRIB = 2;    // aMVP 2..5, aSurface 6
+static const int INSTANCE_ATTRIBS = 5;
 
-        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-        glVertexAttribPointer(locPos, 3, GL_FLOAT, GL_FALSE, 0, (const void*)0);
-        glEnableVertexAttribArray(locPos);
+// instance k of K; `t` sweeps the parameters under --animate, each instance
+// out of phase with the next
+// zscale and freq of the k-th surface of a wall or scene, spread evenly
+static void variantParams(int k, float& zscale, float& freq){
+    const float u = fmodf(k*0.618034f, 1.0f), v = fmodf(k*0.381966f + 0.5f, 1.0f);
+    zscale = 0.6f + 0.8f*u; freq = 0.6f + 1.2f*v;
+}
 
-        glBindBuffer(GL_ARRAY_BUFFER, mesh.cbo);
-        glVertexAttribPointer(locCol, 3, GL_FLOAT, GL_FALSE, 0, (const void*)0);
-        glEnableVertexAttribArray(locCol);
+static void writeInstances(InstanceSet& s, int K, int N, float radius, bool animate, float t){
+    const int cols = int(ceilf(sqrtf(float(K))));
+    const float cell = 3.0f/cols;
+    s.host.resize(K);
+    for (int k=0; k<K; ++k){
+        Instance& in = s.host[k];
+        memset(in.model, 0, sizeof(in.model));
+        in.model[0] = in.model[5] = in.model[10] = 1.0f/cols;
+        in.model[12] = -1.5f + (k%cols + 0.5f)*cell;
+        in.model[13] = -1.5f + (k/cols + 0.5f)*cell;
+        in.model[15] = 1.0f;
+        float zscale, freq;
+        variantParams(k, zscale, freq);
+        if (animate) { zscale *= 1.0f + 0.3f*sinf(t*1.1f + k); freq *= 1.0f + 0.5f*sinf(t*0.7f + k); }
+        float zmin, zmax;
+        surfaceRange(N, radius, zscale, freq, zmin, zmax);
+        float range = zmax - zmin; if (range < 1e-6f) range = 1.0f;
+        in.surface[0] = zscale; in.surface[1] = freq; in.surface[2] = zmin; in.surface[3] = 1.0f/range;
+    }
+    if (!s.vbo) glGenBuffers(1, &s.vbo);
+}
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
-        glDrawElements(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_SHORT, 0);
+// dst[i] = src[i] with its model matrix taken to VP * model
+static void writeInstanceMVPs(const Mat4& VP, const Instance* src, size_t n, Instance* dst){
+    for (size_t i=0; i<n; ++i){
+        Mat4 M;
+        memcpy(M.m, src[i].model, sizeof M.m);
+        const Mat4 R = mul(VP, M);
+        memcpy(dst[i].model, R.m, sizeof R.m);
+        memcpy(dst[i].surface, src[i].surface, sizeof dst[i].surface);
+    }
+}
 
-        SDL_GL_SwapWindow(win);
-        ang += 0.02f;
+// once per frame: the MVPs go straight into the mapped instance buffer (or
+// its staging copy), or to `frame` for the constant-attribute fallback
+static void uploadInstanceMVPs(InstanceSet& s, const Mat4& VP){
+    const size_t n = s.host.size();
+    if (!caps.instanced) {
+        s.frame.resize(n);
+        writeInstanceMVPs(VP, s.host.data(), n, s.frame.data());
+        return;
     }
+    bindUploadBuffer(GL_ARRAY_BUFFER, s.vbo);
+    fillBuffer(GL_ARRAY_BUFFER, n*sizeof(Instance), GL_DYNAMIC_DRAW,
+               [&](void* p){ writeInstanceMVPs(VP, s.host.data(), n, (Instance*)p); });
+}
+
+static void destroyInstances(InstanceSet& s){
+    deleteBuffer(s.vbo);
+    s = InstanceSet();
+}
 
+// draw calls drawMesh issues for `inst`: one per range when instancing
+// exists, else one per range and instance
+static size_t instanceDrawCalls(const Mesh& m, const InstanceSet& inst){
+    return m.ranges.size() * (caps.instanced ? 1 : inst.host.size());
+}
+
+// without instancing the per-instance attributes become constant ones, set
+// before each of K ordinary draws
+static void drawInstances(const Mesh& m, const InstanceSet& inst, const DrawRange& dr, size_t isz){
+    const void* first = (const void*)(size_t(dr.first)*isz);
+    if (caps.instanced) {
+        ext.DrawElementsInstanced(m.prim, dr.count, m.indexType, first, GLsizei(inst.host.size()));
+        countCalls();
+        return;
+    }
+    for (const Instance& in : inst.frame){
+        for (int c=0;c<4;++c) glVertexAttrib4fv(INSTANCE_ATTRIB+c, in.model + 4*c);
+        glVertexAttrib4fv(INSTANCE_ATTRIB+4, in.surface);
+        glDrawElements(m.prim, dr.count, m.indexType, first);
+        countCalls(6);
+    }
+}
+
+// instance arrays of `inst` on INSTANCE_ATTRIB.., or with nullptr off again
+static void setInstanceAttributes(const InstanceSet* inst){
+    if (inst) bindBuffer(GL_ARRAY_BUFFER, inst->vbo);
+    for (int a=0; a<INSTANCE_ATTRIBS; ++a){
+        if (!inst) {
+            attribDivisor(INSTANCE_ATTRIB+a, 0);
+            enableAttrib(INSTANCE_ATTRIB+a, false);
+            continue;
+        }
+        enableAttrib(INSTANCE_ATTRIB+a, true);
+        attribPointer(INSTANCE_ATTRIB+a, 4, GL_FLOAT, GL_FALSE, sizeof(Instance),
+                      (const void*)(a*4*sizeof(float)));
+        attribDivisor(INSTANCE_ATTRIB+a, 1);
+    }
+}
+
+// the mesh's own attributes for range `dr`
+static void setMeshAttributes(const Mesh& m, const DrawRange& dr){
+    bindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    enableAttrib(0, true);
+    if (m.gpuEval) {
+        enableAttrib(1, false);
+        const size_t off = size_t(dr.baseVertex)*2*sizeof(GLushort);
+        attribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, (const void*)off);
+        return;
+    }
+    const GLsizei stride = (GLsizei)vertexSize(m);
+    const size_t colOff = m.halfPos ? offsetof(VertexHalf, col) : offsetof(Vertex, col);
+    const size_t off = size_t(dr.baseVertex)*stride;
+    enableAttrib(1, !m.lut);
+    if (m.halfPos) attribPointer(0, 4, GL_HALF_FLOAT_OES, GL_FALSE, stride, (const void*)off);
+    else           attribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const void*)off);
+    if (!m.lut) attribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, (const void*)(off+colOff));
+}
+
+// One vertex array per range records the index buffer and every attribute
+// pointer, so a draw is a bind instead of the calls above. They are made on
+// first draw, on the thread that owns the context, and again if the
+// instance buffer changes.
+static void makeVertexArrays(Mesh& m, const InstanceSet* inst){
+    deleteVertexArrays(m.vaos);
+    m.vaos.assign(m.ranges.size(), 0);
+    ext.GenVertexArrays(GLsizei(m.vaos.size()), m.vaos.data());
+    for (size_t r=0; r<m.ranges.size(); ++r){
+        bindVertexArray(m.vaos[r]);
+        bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+        if (inst && caps.instanced) setInstanceAttributes(inst);
+        setMeshAttributes(m, m.ranges[r]);
+    }
+    bindVertexArray(0);
+    m.vaoInstances = inst ? inst->vbo : 0;
+}
+
+// Frustum planes of MVP (row 3 plus or minus rows 0..2); a tile is dropped
+// when its box lies wholly behind one of them. The surface is drawn two-sided
+// and tilts through every angle, so a tile is never back-facing as a whole
+// and the frustum is the only test. Adjacent survivors merge into one run.
+static void cullTiles(Mesh& m, const Mat4& MVP){
+    float planes[6][4];
+    const float* a = MVP.m;
+    for (int k=0;k<3;++k)
+        for (int c=0;c<4;++c){
+            planes[2*k][c]   = a[c*4+3] + a[c*4+k];
+            planes[2*k+1][c] = a[c*4+3] - a[c*4+k];
+        }
+    m.visible.clear();
+    m.visibleTriangles = 0;
+    for (const GridTile& t : m.tiles){
+        bool inside = true;
+        for (int k=0; k<6 && inside; ++k){
+            const float* p = planes[k];
+            // the box corner farthest along the plane normal
+            inside = p[0]*(p[0] > 0 ? t.x1 : t.x0) + p[1]*(p[1] > 0 ? t.y1 : t.y0)
+                   + p[2]*(p[2] > 0 ? t.zmax : t.zmin) + p[3] >= 0.0f;
+        }
+        if (!inside) continue;
+        m.visibleTriangles += size_t(t.count/3);
+        if (!m.visible.empty()) {
+            TileRun& r = m.visible.back();
+            if (r.range == t.range && r.first + r.count == t.first) { r.count += t.count; continue; }
+        }
+        TileRun r;
+        r.range = t.range; r.first = t.first; r.count = t.count;
+        m.visible.push_back(r);
+    }
+}
+
+// triangles renderFrame submits for the mesh, after culling
+static size_t drawnTriangles(const Mesh& m, const InstanceSet* inst){
+    if (inst) return m.triangles * inst->host.size();
+    return m.tiles.empty() ? m.triangles : m.visibleTriangles;
+}
+
+// `inst` draws a GPU_EVAL mesh once per instance with the INSTANCED program;
+// a tiled mesh draws what the last cullTiles left
+static void drawMesh(Mesh& m, const Program& p, const InstanceSet* inst=nullptr){
+    const size_t isz = (m.indexType==GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
+    if (m.gpuEval || p.lit || p.lut) {
+        float range = m.zmax - m.zmin; if (range < 1e-6f) range = 1.0f;
+        const float grid[4] = { -m.radius, 2.0f*m.radius/(m.N-1), 1.5f/m.radius, 0.0f };
+        const float surface[4] = { m.zscale, m.freq, m.zmin, 1.0f/range };
+        setSurface(p, grid, surface);
+    }
+    // whole ranges, or the runs of tiles cullTiles kept
+    const bool culled = !inst && !m.tiles.empty();
+    const size_t draws = culled ? m.visible.size() : m.ranges.size();
+    auto drawAt = [&](size_t k, int& range){
+        DrawRange dr = m.ranges[culled ? m.visible[k].range : int(k)];
+        if (culled) { dr.first = m.visible[k].first; dr.count = m.visible[k].count; }
+        range = culled ? m.visible[k].range : int(k);
+        return dr;
+    };
+    auto draw = [&](const DrawRange& dr){
+        if (inst) { drawInstances(m, *inst, dr, isz); return; }
+        glDrawElements(m.prim, dr.count, m.indexType, (const void*)(size_t(dr.first)*isz));
+        countCalls();
+    };
+    // the array stays bound after the last range; nothing else draws from
+    // array 0 while vertex arrays are in use
+    if (caps.vertexArray) {
+        if (m.vaos.empty() || m.vaoInstances != (inst ? inst->vbo : 0)) makeVertexArrays(m, inst);
+        for (size_t k=0; k<draws; ++k){
+            int range;
+            const DrawRange dr = drawAt(k, range);
+            bindVertexArray(m.vaos[range]);
+            draw(dr);
+        }
+        return;
+    }
+    bindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+    const bool instanceArrays = inst && caps.instanced;
+    if (instanceArrays) setInstanceAttributes(inst);
+    for (size_t k=0; k<draws; ++k){
+        int range;
+        const DrawRange dr = drawAt(k, range);
+        setMeshAttributes(m, m.ranges[range]);
+        draw(dr);
+    }
+    if (instanceArrays) setInstanceAttributes(nullptr);
+}
+
+static void destroyMesh(Mesh& m){
+    deleteVertexArrays(m.vaos);
+    deleteBuffer(m.vbo);
+    deleteBuffer(m.ibo);
+    m = Mesh();
+}
+
+// --scene: K CPU grids with their own zscale/freq, packed back to back into
+// shared buffers. Each object is one DrawItem; the list is sorted by program
+// and buffer, and drawScene binds each buffer's vertex state once and merges
+// neighbouring items that need no uniform in between into one draw. With
+// per-vertex colour and float positions the object's placement is baked into
+// its vertices, so a buffer is a single call however many objects it holds;
+// LIT and LUT read the model-space surface, so there every object keeps a
+// model matrix and its own uSurface and is a uniform update plus a draw.
+struct DrawItem {
+    const Program* prog = nullptr;
+    int buffer = 0;             // Scene::buffers
+    GLsizei first = 0, count = 0;
+    Mat4 model = Mat4::identity();
+    float surface[4] = {};      // zscale, freq, zmin, 1/(zmax-zmin)
+};
+struct Scene {
+    int N = 0;
+    std::vector<Mesh> buffers;  // one range each; 16-bit ones hold <= 65,536 vertices
+    std::vector<DrawItem> items;
+    size_t triangles = 0;
+    float radius = 0;
+};
+
+static bool drawKeyLess(const DrawItem& a, const DrawItem& b){
+    if (a.prog->id != b.prog->id) return a.prog->id < b.prog->id;
+    if (a.buffer != b.buffer) return a.buffer < b.buffer;
+    return a.first < b.first;
+}
+
+// the same placement and parameter spread as the --instances wall
+static Mat4 sceneModel(int k, int K){
+    const int cols = int(ceilf(sqrtf(float(K))));
+    const float cell = 3.0f/cols;
+    Mat4 M = translate(-1.5f + (k%cols + 0.5f)*cell, -1.5f + (k/cols + 0.5f)*cell, 0.0f);
+    M.m[0] = M.m[5] = M.m[10] = 1.0f/cols;
+    return M;
+}
+
+// uploads the buffer being packed and starts the next one
+static void flushSceneBuffer(Scene& sc, Mesh& g, std::vector<GLubyte>& verts, std::vector<GLuint>& idx){
+    if (idx.empty()) return;
+    g.indexType = (g.vertices <= 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    g.indexCount = GLsizei(idx.size());
+    g.ranges.assign(1, DrawRange());
+    g.ranges[0].count = g.indexCount;
+    uploadBuffer(g.vbo, GL_ARRAY_BUFFER, verts.size(), GL_STATIC_DRAW,
+                 [&](void* p){ memcpy(p, verts.data(), verts.size()); });
+    const size_t isz = (g.indexType == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
+    uploadBuffer(g.ibo, GL_ELEMENT_ARRAY_BUFFER, idx.size()*isz, GL_STATIC_DRAW, [&](void* p){
+        if (isz == sizeof(GLuint)) memcpy(p, idx.data(), idx.size()*isz);
+        else std::copy(idx.begin(), idx.end(), (GLushort*)p);
+    });
+    sc.buffers.push_back(std::move(g));
+    g = Mesh();
+    verts.clear(); idx.clear();
+}
+
+// each object's grid is built staged, so its bytes can be appended (and its
+// indices rebased) before anything reaches GL
+static Scene makeScene(int K, int N, float radius, const Program& prog, MeshOptions opt){
+    Scene sc;
+    // each object must fit one 16-bit range to be rebased into its buffer
+    if (!caps.uintIndex && N > 256) {
+        fprintf(stderr,"--scene N=%d needs OES_element_index_uint; clamping to 256\n", N);
+        N = 256;
+    }
+    sc.N = N = clampGridSize(N);
+    sc.radius = radius;
+    opt.dynamic = false;
+    const size_t limit = caps.uintIndex ? SIZE_MAX : 65536;
+    Mesh g;
+    std::vector<GLubyte> verts;
+    std::vector<GLuint> idx;
+    for (int k=0; k<K; ++k){
+        float zscale, freq;
+        variantParams(k, zscale, freq);
+        if (g.vertices + size_t(N)*N > limit) flushSceneBuffer(sc, g, verts, idx);
+        MeshStaging st;
+        st.arena = &glArena;
+        meshStaging = &st;
+        Mesh m = makeSombrero(N, radius, zscale, freq, opt);
+        meshStaging = nullptr;
+        const StagedBuffer& vb = st.buffers[0];
+        const StagedBuffer& ib = st.buffers[1];
+
+        DrawItem it;
+        it.prog = &prog;
+        it.buffer = int(sc.buffers.size());
+        it.first = GLsizei(idx.size());
+        it.count = m.indexCount;
+        float range = m.zmax - m.zmin; if (range < 1e-6f) range = 1.0f;
+        it.surface[0] = zscale; it.surface[1] = freq; it.surface[2] = m.zmin; it.surface[3] = 1.0f/range;
+        const Mat4 M = sceneModel(k, K);
+        const size_t at = verts.size();
+        verts.insert(verts.end(), vb.bytes, vb.bytes + vb.size);
+        if (!prog.lit && !m.lut && !m.halfPos) {
+            Vertex* v = (Vertex*)(verts.data() + at);
+            for (size_t i=0; i<m.vertices; ++i){
+                const float x = v[i].pos[0], y = v[i].pos[1], z = v[i].pos[2];
+                for (int r=0; r<3; ++r) v[i].pos[r] = M.m[r]*x + M.m[4+r]*y + M.m[8+r]*z + M.m[12+r];
+            }
+        }
+        else it.model = M;
+        const GLuint base = GLuint(g.vertices);
+        if (m.indexType == GL_UNSIGNED_INT)
+            for (GLsizei i=0; i<m.indexCount; ++i) idx.push_back(base + ((const GLuint*)ib.bytes)[i]);
+        else
+            for (GLsizei i=0; i<m.indexCount; ++i) idx.push_back(base + ((const GLushort*)ib.bytes)[i]);
+        g.N = N; g.prim = m.prim; g.halfPos = m.halfPos; g.lut = m.lut;
+        g.vertices += m.vertices;
+        g.triangles += m.triangles;
+        sc.triangles += m.triangles;
+        sc.items.push_back(it);
+        glArena.reset();
+    }
+    flushSceneBuffer(sc, g, verts, idx);
+    std::sort(sc.items.begin(), sc.items.end(), drawKeyLess);
+    return sc;
+}
+
+// end of the run of items from i that one draw covers; count gets its indices
+static size_t sceneRun(const Scene& sc, size_t i, GLsizei& count){
+    const DrawItem& a = sc.items[i];
+    const bool surface = a.prog->lit || a.prog->lut;
+    count = a.count;
+    size_t j = i+1;
+    for (; j<sc.items.size(); ++j){
+        const DrawItem& b = sc.items[j];
+        if (b.prog != a.prog || b.buffer != a.buffer || b.first != a.first + count) break;
+        if (memcmp(b.model.m, a.model.m, sizeof a.model.m)) break;
+        if (surface && memcmp(b.surface, a.surface, sizeof a.surface)) break;
+        count += b.count;
+    }
+    return j;
+}
+static size_t sceneDrawCalls(const Scene& sc){
+    size_t calls = 0;
+    GLsizei count;
+    for (size_t i=0; i<sc.items.size(); i=sceneRun(sc, i, count)) ++calls;
+    return calls;
+}
+
+// the state cache drops the rebinds between items of one buffer
+static void drawScene(Scene& sc, const Mat4& VP){
+    const float grid[4] = { -sc.radius, 2.0f*sc.radius/(sc.N-1), 1.5f/sc.radius, 0.0f };
+    GLsizei count;
+    for (size_t i=0, j; i<sc.items.size(); i=j){
+        j = sceneRun(sc, i, count);
+        const DrawItem& it = sc.items[i];
+        Mesh& g = sc.buffers[it.buffer];
+        useProgram(it.prog->id);
+        setMVP(*it.prog, mul(VP, it.model).m);
+        if (it.prog->lit || it.prog->lut) setSurface(*it.prog, grid, it.surface);
+        if (caps.vertexArray) {
+            if (g.vaos.empty()) makeVertexArrays(g, nullptr);
+            bindVertexArray(g.vaos[0]);
+        } else {
+            bindBuffer(GL_ELEMENT_ARRAY_BUFFER, g.ibo);
+            setMeshAttributes(g, g.ranges[0]);
+        }
+        const size_t isz = (g.indexType == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
+        glDrawElements(g.prim, count, g.indexType, (const void*)(size_t(it.first)*isz));
+        countCalls();
+    }
+}
+
+static void destroyScene(Scene& sc){
+    for (Mesh& g : sc.buffers) destroyMesh(g);
+    sc = Scene();
+}
+
+// colour texture + depth renderbuffer render target
+struct Framebuffer {
+    GLuint fbo=0, color=0, depth=0;
+    int w=0, h=0;
+};
+static bool makeFramebuffer(Framebuffer& fb, int w, int h){
+    fb.w=w; fb.h=h;
+    glGenTextures(1,&fb.color); glBindTexture(GL_TEXTURE_2D, fb.color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenRenderbuffers(1,&fb.depth); glBindRenderbuffer(GL_RENDERBUFFER, fb.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, caps.depth24 ? GL_DEPTH_COMPONENT24_OES : GL_DEPTH_COMPONENT16, w, h);
+    glGenFramebuffers(1,&fb.fbo); glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fb.color, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, fb.depth);
+    const bool ok = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return ok;
+}
+static void destroyFramebuffer(Framebuffer& fb){
+    glDeleteFramebuffers(1,&fb.fbo);
+    glDeleteRenderbuffers(1,&fb.depth);
+    glDeleteTextures(1,&fb.color);
+    fb = Framebuffer();
+}
+
+// --lut gradients: LUT_SIZE x 1 RGBA textures bound on unit 0 for uLut.
+// Switching the map rewrites the texels; no mesh depends on it.
+static const int LUT_SIZE = 256;    // LUT_SIZE in FS_SRC
+enum ColourMap { MAP_RAMP, MAP_HEAT, MAP_GRAY, MAP_COUNT };
+static const char* const colourMapNames[MAP_COUNT] = { "ramp", "heat", "gray" };
+static void colourMapTexel(ColourMap map, float t, GLubyte* c){
+    auto unit = [](float v){ return GLubyte((v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v)*255.0f + 0.5f); };
+    switch (map) {
+    case MAP_RAMP: heightColour(t, c); return;      // the per-vertex colours
+    case MAP_HEAT: c[0]=unit(3.0f*t); c[1]=unit(3.0f*t-1.0f); c[2]=unit(3.0f*t-2.0f); break;
+    default:       c[0]=c[1]=c[2]=unit(t); break;
+    }
+    c[3]=255;
+}
+static void setColourMap(GLuint tex, ColourMap map){
+    GLubyte texels[LUT_SIZE*4];
+    for (int k=0;k<LUT_SIZE;++k) colourMapTexel(map, float(k)/(LUT_SIZE-1), texels + 4*k);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LUT_SIZE, 1, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    countCalls(2);
+}
+static GLuint makeColourLut(ColourMap map){
+    GLuint tex=0;
+    glGenTextures(1,&tex); glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, LUT_SIZE, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    setColourMap(tex, map);
+    return tex;
+}
+
+// --budget draws into a smaller Framebuffer and stretches its colour
+// texture over the real target with one textured quad (bilinear). The
+// texture goes on unit 1 so the LUT keeps unit 0.
+static const char* UPSCALE_VS = R"(
+attribute vec2 aPos;
+varying vec2 vUV;
+void main() {
+    vUV = aPos*0.5 + 0.5;
+    gl_Position = vec4(aPos, 0.0, 1.0);
+}
+)";
+static const char* UPSCALE_FS = R"(
+precision mediump float;
+uniform sampler2D uSrc;
+varying vec2 vUV;
+void main() {
+    gl_FragColor = texture2D(uSrc, vUV);
+}
+)";
+struct Upscaler {
+    GLuint program=0, vbo=0;
+};
+static Upscaler makeUpscaler(){
+    Upscaler u;
+    u.program = linkProgram("", UPSCALE_VS, UPSCALE_FS);
+    useProgram(u.program);
+    glUniform1i(glGetUniformLocation(u.program, "uSrc"), 1);
+    static const float quad[8] = { -1,-1, 1,-1, -1,1, 1,1 };
+    glGenBuffers(1, &u.vbo);
+    bindBuffer(GL_ARRAY_BUFFER, u.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof quad, quad, GL_STATIC_DRAW);
+    return u;
+}
+// with the destination framebuffer and its viewport already set
+static void upscale(const Upscaler& u, const Framebuffer& src){
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, src.color);
+    glActiveTexture(GL_TEXTURE0);
+    glDisable(GL_DEPTH_TEST);
+    useProgram(u.program);
+    if (caps.vertexArray) bindVertexArray(0);
+    bindBuffer(GL_ARRAY_BUFFER, u.vbo);
+    enableAttrib(0, true);
+    enableAttrib(1, false);
+    attribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glEnable(GL_DEPTH_TEST);
+    countCalls(6);
+}
+static void destroyUpscaler(Upscaler& u){
+    glDeleteProgram(u.program);
+    if (glState.program == u.program) glState.program = UNKNOWN_NAME;
+    deleteBuffer(u.vbo);
+    u = Upscaler();
+}
+
+// --capture: every frame is read back from the FBO and streamed to a file or
+// a pipe by a writer thread, as concatenated binary PPMs or one YUV4MPEG2
+// (4:4:4, BT.601) stream, either of which ffmpeg reads from a pipe. On
+// ES 3.0 glReadPixels goes into a ring of pixel pack buffers, each
+// mapped only once the fence behind it has signalled, so the GPU is never
+// waited on. On ES 2.0 glReadPixels is synchronous and reads straight into
+// a host frame. If the ring or every host frame is still busy, the frame is
+// dropped and counted, so the render loop never waits for the writer.
+enum CaptureFormat { CAPTURE_PPM, CAPTURE_Y4M };
+class FrameCapture {
+public:
+    static const int RING = 3;      // pixel pack buffers in flight
+    static const int FRAMES = 4;    // host frames between readback and writer
+    // path: a file, "-" for stdout or "|command" for a pipe into command
+    bool open(const char* path, CaptureFormat format, int width, int height, double fps) {
+        if (path[0] == '|') { out = popen(path+1, "w"); piped = true; }
+        else out = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+        if (!out) return false;
+        signal(SIGPIPE, SIG_IGN);   // a closed pipe fails the write instead
+        fmt = format; w = width; h = height;
+        const size_t bytes = size_t(w)*h*4;
+        for (int k=0;k<FRAMES;++k) { frames[k].resize(bytes); freeFrames.push_back(k); }
+        if (caps.pixelPack) {
+            glGenBuffers(RING, pbo);
+            for (int k=0;k<RING;++k) {
+                bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, pbo[k]);
+                glBufferData(GL_PIXEL_PACK_BUFFER_ES3, GLsizeiptr(bytes), nullptr, GL_STREAM_READ_ES3);
+            }
+            bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, 0);
+        }
+        if (fmt == CAPTURE_Y4M)
+            fprintf(out, "YUV4MPEG2 W%d H%d F%ld:1000 Ip A1:1 C444\n", w, h, lround(fps*1000.0));
+        writer = std::thread([this]{ run(); });
+        return true;
+    }
+    bool active() const { return out != nullptr; }
+    // the writer gave up, e.g. the reading end of the pipe went away
+    bool failed() const { return writeFailed; }
+    // after drawing a frame, with its framebuffer bound
+    void grab() {
+        if (!caps.pixelPack) {
+            const int f = takeFrame();
+            if (f < 0) { ++dropped; return; }
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, frames[f].data());
+            countCalls();
+            submit(f);
+            return;
+        }
+        retire(false);
+        if (inFlight == RING) { ++dropped; return; }
+        const int k = (head + inFlight) % RING;
+        bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, pbo[k]);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, 0);
+        fence[k] = ext.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE_ES3, 0);
+        countCalls(2);
+        ++inFlight;
+    }
+    // waits for the frames still in flight and the writer, then closes
+    void close() {
+        if (!out) return;
+        retire(true);
+        { std::lock_guard<std::mutex> l(mu); stop = true; }
+        cv.notify_all();
+        writer.join();
+        if (caps.pixelPack) glDeleteBuffers(RING, pbo);
+        for (int k=0;k<RING;++k) pbo[k] = 0;
+        if (piped) pclose(out); else if (out != stdout) fclose(out); else fflush(out);
+        out = nullptr;
+    }
+    uint64_t written = 0, dropped = 0;
+
+private:
+    // copies every signalled buffer at the head of the ring to a host frame;
+    // wait: block on the fences too (only when closing)
+    void retire(bool wait) {
+        while (inFlight > 0) {
+            const GLenum r = ext.ClientWaitSync(fence[head], GL_SYNC_FLUSH_COMMANDS_BIT_ES3,
+                                                wait ? GLuint64(1000000000) : 0);
+            countCalls();
+            if (r == GL_TIMEOUT_EXPIRED_ES3 && !wait) return;
+            ext.DeleteSync(fence[head]);
+            fence[head] = nullptr;
+            const int f = (r == GL_WAIT_FAILED_ES3) ? -1 : takeFrame(wait);
+            if (f < 0) ++dropped;
+            else {
+                bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, pbo[head]);
+                const void* p = ext.MapBufferRange(GL_PIXEL_PACK_BUFFER_ES3, 0, GLsizeiptr(frames[f].size()), GL_MAP_READ_BIT_ES3);
+                if (p) memcpy(frames[f].data(), p, frames[f].size());
+                ext.UnmapBufferES3(GL_PIXEL_PACK_BUFFER_ES3);
+                bindBuffer(GL_PIXEL_PACK_BUFFER_ES3, 0);
+                countCalls(2);
+                if (p) submit(f);
+                else { returnFrame(f); ++dropped; }
+            }
+            head = (head + 1) % RING;
+            --inFlight;
+        }
+    }
+    int takeFrame(bool wait=false) {
+        std::unique_lock<std::mutex> l(mu);
+        if (wait) cv.wait(l, [this]{ return !freeFrames.empty() || writeFailed; });
+        if (freeFrames.empty() || writeFailed) return -1;
+        const int f = freeFrames.back();
+        freeFrames.pop_back();
+        return f;
+    }
+    void returnFrame(int f) {
+        { std::lock_guard<std::mutex> l(mu); freeFrames.push_back(f); }
+        cv.notify_all();
+    }
+    void submit(int f) {
+        { std::lock_guard<std::mutex> l(mu); fullFrames.push_back(f); }
+        cv.notify_all();
+    }
+    void run() {
+        std::vector<GLubyte> row(size_t(w)*3);
+        for (;;) {
+            int f;
+            {
+                std::unique_lock<std::mutex> l(mu);
+                cv.wait(l, [this]{ return stop || !fullFrames.empty(); });
+                if (fullFrames.empty()) return;
+                f = fullFrames.front();
+                fullFrames.pop_front();
+            }
+            const bool ok = !writeFailed && writeFrame(frames[f].data(), row);
+            if (ok) ++written;
+            else writeFailed = true;
+            returnFrame(f);
+        }
+    }
+    // rows arrive bottom-up from glReadPixels
+    bool writeFrame(const GLubyte* rgba, std::vector<GLubyte>& row) {
+        if (fmt == CAPTURE_PPM) {
+            fprintf(out, "P6\n%d %d\n255\n", w, h);
+            for (int y=h-1; y>=0; --y) {
+                const GLubyte* s = rgba + size_t(y)*w*4;
+                for (int x=0;x<w;++x) { row[3*x]=s[4*x]; row[3*x+1]=s[4*x+1]; row[3*x+2]=s[4*x+2]; }
+                if (fwrite(row.data(), 1, size_t(w)*3, out) != size_t(w)*3) return false;
+            }
+            return fflush(out) == 0;
+        }
+        fputs("FRAME\n", out);
+        for (int plane=0; plane<3; ++plane) {
+            for (int y=h-1; y>=0; --y) {
+                const GLubyte* s = rgba + size_t(y)*w*4;
+                for (int x=0;x<w;++x) {
+                    const int r = s[4*x], g = s[4*x+1], b = s[4*x+2];
+                    row[x] = GLubyte(plane == 0 ? ((66*r + 129*g + 25*b + 128) >> 8) + 16
+                                   : plane == 1 ? ((-38*r - 74*g + 112*b + 128) >> 8) + 128
+                                                : ((112*r - 94*g - 18*b + 128) >> 8) + 128);
+                }
+                if (fwrite(row.data(), 1, size_t(w), out) != size_t(w)) return false;
+            }
+        }
+        return fflush(out) == 0;
+    }
+
+    FILE* out = nullptr;
+    bool piped = false;
+    CaptureFormat fmt = CAPTURE_PPM;
+    int w = 0, h = 0;
+    GLuint pbo[RING] = {};
+    GLsync fence[RING] = {};
+    int head = 0, inFlight = 0;     // ring in use: [head, head+inFlight)
+    std::vector<GLubyte> frames[FRAMES];
+    std::vector<int> freeFrames;    // the rest are queued or being written
+    std::deque<int> fullFrames;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stop = false;
+    std::atomic<bool> writeFailed{false};
+    std::thread writer;
+};
+
+static size_t indexBytes(const Mesh& m){
+    return size_t(m.indexCount) * ((m.indexType==GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort));
+}
+
+// On-disk copy of a finished static mesh: header, ranges, radial rings, then
+// the vertex and index bytes exactly as uploaded, each 16-byte aligned. The
+// key holds everything the bytes depend on, including the row kernel since
+// the vector kernels round differently from libm. A hit maps the file and
+// hands the mapping to glBufferData; any mismatch is treated as a miss.
+static const uint32_t MESH_CACHE_VERSION = 4;
+
+struct MeshCacheKey {
+    char magic[8];
+    uint32_t version, headerBytes;
+    int32_t N;
+    float radius, zscale, freq;
+    uint8_t gpuEval, halfPos, radial, uintIndex, lut;
+    int32_t topology;
+    char kernel[8];
+    char surface[12];
+};
+struct MeshCacheHeader {
+    MeshCacheKey key;
+    uint32_t prim, indexType;
+    int32_t N, indexCount;
+    uint64_t vertices, triangles, vertexBytes, indexBytes;
+    uint32_t ranges, rings;
+    float zmin, zmax;
+};
+
+static MeshCacheKey meshCacheKey(int N, float radius, float zscale, float freq,
+                                 const MeshOptions& opt, bool gpuEval){
+    MeshCacheKey k;
+    memset(&k, 0, sizeof k);    // padding takes part in the compare and the hash
+    memcpy(k.magic, "MEXHAT\x1a", 8);
+    k.version = MESH_CACHE_VERSION;
+    k.headerBytes = sizeof(MeshCacheHeader);
+    k.N = N; k.radius = radius; k.zscale = zscale; k.freq = freq;
+    k.gpuEval = gpuEval;
+    k.halfPos = !gpuEval && opt.halfPos && caps.halfFloat;
+    k.lut = !gpuEval && opt.lut;
+    k.radial = !gpuEval && opt.radial;
+    k.uintIndex = caps.uintIndex;
+    k.topology = k.radial ? TOPO_LIST : opt.topology;
+    strncpy(k.kernel, gpuEval ? "gpu" : rowKernelName, sizeof k.kernel - 1);
+    strncpy(k.surface, currentSurface->name, sizeof k.surface - 1);
+    return k;
+}
+
+static std::string meshCachePath(const char* dir, const MeshCacheKey& k){
+    uint64_t h = 1469598103934665603ull;    // FNV-1a
+    for (size_t i=0;i<sizeof k;++i){ h ^= ((const uint8_t*)&k)[i]; h *= 1099511628211ull; }
+    char name[64];
+    snprintf(name, sizeof name, "/mexhat-%016llx.mesh", (unsigned long long)h);
+    return std::string(dir) + name;
+}
+
+static size_t align16(size_t n){ return (n + 15) & ~size_t(15); }
+
+static size_t meshCacheLayout(const MeshCacheHeader& h, size_t* ringOff, size_t* vertexOff, size_t* indexOff){
+    size_t off = align16(sizeof h);
+    off = align16(off + h.ranges*sizeof(DrawRange));
+    *ringOff = off;
+    off = align16(off + h.rings*sizeof(RadialRing));
+    *vertexOff = off;
+    off = align16(off + h.vertexBytes);
+    *indexOff = off;
+    return off + h.indexBytes;
+}
+
+static bool loadMeshCache(const std::string& path, const MeshCacheKey& key, Mesh& m){
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(MeshCacheHeader))
+        map = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    const GLubyte* base = (const GLubyte*)map;
+    MeshCacheHeader h;
+    memcpy(&h, base, sizeof h);
+    size_t ringOff = 0, vertexOff = 0, indexOff = 0;
+    Mesh layout;
+    layout.gpuEval = key.gpuEval; layout.halfPos = key.halfPos; layout.lut = key.lut;
+    const uint32_t prim = key.topology == TOPO_STRIP ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+    const uint64_t isz = h.indexType == GL_UNSIGNED_INT ? 4 : 2;
+    bool ok = !memcmp(&h.key, &key, sizeof key) && h.N == key.N && h.indexCount >= 0
+           && h.prim == prim
+           && (h.indexType == GL_UNSIGNED_SHORT || (h.indexType == GL_UNSIGNED_INT && key.uintIndex))
+           && h.vertices < (1ull<<32) && h.ranges < (1u<<20) && h.rings < (1u<<20)
+           && uint64_t(h.indexCount)*isz == h.indexBytes
+           && h.vertices*vertexSize(layout) == h.vertexBytes
+           && meshCacheLayout(h, &ringOff, &vertexOff, &indexOff) == size_t(st.st_size);
+    // a stale or damaged file of the right size must not draw past its
+    // indices or point attributes past its vertices
+    const DrawRange* ranges = (const DrawRange*)(base + align16(sizeof h));
+    for (uint32_t r=0; ok && r<h.ranges; ++r){
+        DrawRange dr;
+        memcpy(&dr, ranges + r, sizeof dr);
+        ok = dr.first >= 0 && dr.count >= 0 && int64_t(dr.first) + dr.count <= h.indexCount
+          && dr.baseVertex >= 0 && uint64_t(dr.baseVertex) < h.vertices;
+    }
+    if (ok) {
+        m = Mesh();
+        m.prim = h.prim; m.indexType = h.indexType;
+        m.N = h.N; m.indexCount = h.indexCount;
+        m.vertices = size_t(h.vertices); m.triangles = size_t(h.triangles);
+        m.gpuEval = key.gpuEval; m.halfPos = key.halfPos; m.lut = key.lut;
+        m.radius = key.radius; m.zscale = key.zscale; m.freq = key.freq;
+        m.zmin = h.zmin; m.zmax = h.zmax;
+        m.ranges.assign(ranges, ranges + h.ranges);
+        const GLubyte* p = base + ringOff;
+        m.rings.assign((const RadialRing*)p, (const RadialRing*)p + h.rings);
+        if (key.topology == TOPO_TILED) layoutTiles(m);
+        if (meshStaging) {
+            // a background load still has to copy into staging
+            uploadBuffer(m.vbo, GL_ARRAY_BUFFER, h.vertexBytes, GL_STATIC_DRAW,
+                         [&](void* p){ memcpy(p, base + vertexOff, h.vertexBytes); });
+            uploadBuffer(m.ibo, GL_ELEMENT_ARRAY_BUFFER, h.indexBytes, GL_STATIC_DRAW,
+                         [&](void* p){ memcpy(p, base + indexOff, h.indexBytes); });
+        } else {
+            glGenBuffers(1,&m.vbo); bindBuffer(GL_ARRAY_BUFFER, m.vbo);
+            glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(h.vertexBytes), base + vertexOff, GL_STATIC_DRAW);
+            glGenBuffers(1,&m.ibo); bindUploadBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, GLsizeiptr(h.indexBytes), base + indexOff, GL_STATIC_DRAW);
+        }
+    }
+    munmap(map, size_t(st.st_size));
+    return ok;
+}
+
+// staged holds the vertex and index buffers of m; the file is written
+// under a temporary name and renamed so readers never see half of it
+static bool saveMeshCache(const std::string& path, const MeshCacheKey& key, const Mesh& m,
+                          const std::vector<StagedBuffer>& staged){
+    if (staged.size() != 2) return false;
+    const StagedBuffer* blocks[2] = { &staged[0], &staged[1] };
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof h);
+    h.key = key;
+    h.prim = m.prim; h.indexType = m.indexType;
+    h.N = m.N; h.indexCount = m.indexCount;
+    h.vertices = m.vertices; h.triangles = m.triangles;
+    h.vertexBytes = blocks[0]->size; h.indexBytes = blocks[1]->size;
+    h.ranges = uint32_t(m.ranges.size()); h.rings = uint32_t(m.rings.size());
+    h.zmin = m.zmin; h.zmax = m.zmax;
+    size_t ringOff = 0, vertexOff = 0, indexOff = 0;
+    const size_t total = meshCacheLayout(h, &ringOff, &vertexOff, &indexOff);
+
+    const std::string tmp = path + ".tmp" + std::to_string(getpid());
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    static const GLubyte zeros[16] = {};
+    auto pad = [&](size_t to){ const long at = ftell(f); if (at >= 0 && size_t(at) < to) fwrite(zeros, 1, to-size_t(at), f); };
+    bool ok = fwrite(&h, sizeof h, 1, f) == 1;
+    pad(align16(sizeof h));
+    ok = ok && fwrite(m.ranges.data(), sizeof(DrawRange), m.ranges.size(), f) == m.ranges.size();
+    pad(ringOff);
+    if (!m.rings.empty())
+        ok = ok && fwrite(m.rings.data(), sizeof(RadialRing), m.rings.size(), f) == m.rings.size();
+    pad(vertexOff);
+    ok = ok && fwrite(blocks[0]->bytes, 1, blocks[0]->size, f) == blocks[0]->size;
+    pad(indexOff);
+    ok = ok && fwrite(blocks[1]->bytes, 1, blocks[1]->size, f) == blocks[1]->size;
+    ok = ok && ftell(f) == long(total);
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) remove(tmp.c_str());
+    return ok;
+}
+
+static double msSince(Uint64 t0){
+    return 1000.0*double(SDL_GetPerformanceCounter()-t0)/double(SDL_GetPerformanceFrequency());
+}
+
+// Creates m's buffers from st in UPLOAD_SLICE pieces of glBufferSubData until
+// about budgetMs has passed (0: no limit); true once all of it is in GL.
+// A dynamic mesh without OES_mapbuffer keeps its vertices as m.host.
+static const size_t UPLOAD_SLICE = size_t(1)<<20;
+static bool uploadStaged(Mesh& m, MeshStaging& st, double budgetMs){
+    const Uint64 t0 = SDL_GetPerformanceCounter();
+    while (st.current < st.buffers.size()){
+        StagedBuffer& b = st.buffers[st.current];
+        GLuint& id = (b.target == GL_ARRAY_BUFFER) ? m.vbo : m.ibo;
+        if (st.sent == 0) {
+            glGenBuffers(1,&id); bindUploadBuffer(b.target, id);
+            glBufferData(b.target, GLsizeiptr(b.size), nullptr, b.usage);
+        } else {
+            bindUploadBuffer(b.target, id);
+        }
+        const size_t n = std::min(UPLOAD_SLICE, b.size - st.sent);
+        if (n) glBufferSubData(b.target, GLintptr(st.sent), GLsizeiptr(n), b.bytes + st.sent);
+        st.sent += n;
+        if (st.sent == b.size) {
+            if (b.target == GL_ARRAY_BUFFER && m.dynamic && !caps.mapBuffer) m.host.assign(b.bytes, b.bytes + b.size);
+            ++st.current; st.sent = 0;
+        }
+        if (budgetMs > 0 && msSince(t0) >= budgetMs) break;
+    }
+    return st.current == st.buffers.size();
+}
+
+// One background thread for mesh builds. A job runs in staged mode with
+// inline evaluation; the main thread calls poll() once per frame, which
+// uploads the result within UPLOAD_BUDGET_MS and hands it over when the last
+// slice is in. One job at a time: submit() only while idle().
+class MeshBuilder {
+public:
+    static constexpr double UPLOAD_BUDGET_MS = 2.0;
+    MeshBuilder() : worker([this]{ run(); }) {}
+    ~MeshBuilder() {
+        { std::lock_guard<std::mutex> l(mu); stop = true; }
+        cv.notify_one();
+        worker.join();
+    }
+    // drops a half-uploaded result; call while the context is still current
+    void shutdown() {
+        std::lock_guard<std::mutex> l(mu);
+        if (state == READY) { destroyMesh(result); state = IDLE; }
+    }
+    size_t scratchHighWater() const { return arena.highWaterBytes(); }
+    bool idle() {
+        std::lock_guard<std::mutex> l(mu);
+        return state == IDLE;
+    }
+    void submit(int tag, std::function<Mesh()> build) {
+        { std::lock_guard<std::mutex> l(mu); job = build; jobTag = tag; state = QUEUED; }
+        cv.notify_one();
+    }
+    bool poll(Mesh& out, int& tag) {
+        std::lock_guard<std::mutex> l(mu);
+        if (state != READY || !uploadStaged(result, staging, UPLOAD_BUDGET_MS)) return false;
+        out = std::move(result); result = Mesh();
+        tag = jobTag;
+        staging = MeshStaging();
+        arena.reset();      // nothing of the job is left; the worker is waiting
+        state = IDLE;
+        return true;
+    }
+
+private:
+    enum State { IDLE, QUEUED, RUNNING, READY };
+    void run() {
+        evalInline = true;
+        std::unique_lock<std::mutex> l(mu);
+        for (;;) {
+            cv.wait(l, [this]{ return stop || state == QUEUED; });
+            if (stop) return;
+            state = RUNNING;
+            std::function<Mesh()> build = std::move(job);
+            l.unlock();
+            MeshStaging st;
+            st.arena = &arena;
+            meshStaging = &st;
+            Mesh m = build();
+            meshStaging = nullptr;
+            l.lock();
+            result = std::move(m);
+            staging = std::move(st);
+            state = READY;
+        }
+    }
+
+    std::mutex mu;
+    std::condition_variable cv;
+    State state = IDLE;
+    bool stop = false;
+    std::function<Mesh()> job;
+    int jobTag = 0;
+    Mesh result;
+    MeshStaging staging;
+    ScratchArena arena;     // the job's staged buffers, reset once uploaded
+    std::thread worker;     // last, so it starts after the members above
+};
+
+// per-frame timings in ms; gpu < 0 when the frame was not sampled
+struct FrameTimes {
+    uint64_t frame=0;
+    double matrix=0, submit=0, gpu=-1, swap=0, total=0;
+    double glCalls=0, glSkipped=0;  // counts from the state cache, not ms
+    double triangles=0;             // submitted after culling
+};
+
+// GPU time of the draw submission. With EXT_disjoint_timer_query a ring of
+// TIME_ELAPSED queries is read back a few frames late without stalling;
+// otherwise every FINISH_EVERY-th frame is drained with glFinish and the time
+// from the start of submission to idle is used as the estimate.
+class GpuTimer {
+public:
+    static const int RING = 4, FINISH_EVERY = 16;
+    // forceFinish: software rasterizers such as llvmpipe answer timer queries
+    // with the (near zero) time to queue the work, so sample with glFinish
+    void init(bool forceFinish) {
+        useQuery = caps.timerQuery && !forceFinish;
+        if (useQuery) ext.GenQueries(RING, queries);
+    }
+    void shutdown() {
+        if (useQuery) ext.DeleteQueries(RING, queries);
+    }
+    const char* method() const { return useQuery ? "timer query" : "glFinish every 16th"; }
+    void begin(uint64_t frame) {
+        cur = frame;
+        t0 = SDL_GetPerformanceCounter();
+        const int q = int(frame%RING);
+        if (useQuery && !busy[q]) { ext.BeginQuery(GL_TIME_ELAPSED_EXT, queries[q]); began[q]=t0; }
+    }
+    // calls done(frame, ms) for every result that became available
+    template<class F>
+    void end(F&& done) {
+        if (!useQuery) {
+            if (cur % FINISH_EVERY == 0) { glFinish(); done(cur, msSince(t0)); }
+            return;
+        }
+        const int q = int(cur%RING);
+        if (!busy[q] && began[q]==t0) { ext.EndQuery(GL_TIME_ELAPSED_EXT); busy[q]=true; owner[q]=cur; }
+        GLint disjoint = 0; glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        for (int k=0;k<RING;++k){
+            if (!busy[k]) continue;
+            GLuint avail = 0; ext.GetQueryObjectuiv(queries[k], GL_QUERY_RESULT_AVAILABLE_EXT, &avail);
+            if (!avail) continue;
+            GLuint64 ns = 0; ext.GetQueryObjectui64v(queries[k], GL_QUERY_RESULT_EXT, &ns);
+            busy[k] = false;
+            // a GPU interval cannot be longer than the wall time since it began
+            const double ms = double(ns)*1e-6;
+            if (!disjoint && ms <= msSince(began[k])) done(owner[k], ms);
+        }
+    }
+private:
+    bool useQuery = false;
+    GLuint queries[RING] = {};
+    bool busy[RING] = {};
+    uint64_t owner[RING] = {};
+    Uint64 began[RING] = {};
+    uint64_t cur = 0;
+    Uint64 t0 = 0;
+};
+
+// Collects FrameTimes, holding each row back LAG frames so a late GPU result
+// can still be attached, then feeds it to the percentile window and the CSV.
+class FrameStats {
+public:
+    static const int LAG = 8;
+    ~FrameStats() { if (csv) fclose(csv); }
+    bool openCsv(const char* path) {
+        csv = fopen(path, "w");
+        if (!csv) return false;
+        fprintf(csv, "frame,matrix_ms,submit_ms,gpu_ms,swap_ms,frame_ms,gl_calls,gl_skipped,triangles\n");
+        return true;
+    }
+    void push(const FrameTimes& t) {
+        pending.push_back(t);
+        while (pending.size() > size_t(LAG)) { retire(pending.front()); pending.pop_front(); }
+    }
+    FrameTimes& back() { return pending.back(); }
+    void setGpu(uint64_t frame, double ms) {
+        for (FrameTimes& t : pending) if (t.frame==frame) { t.gpu = ms; return; }
+    }
+    void flush() {
+        for (const FrameTimes& t : pending) retire(t);
+        pending.clear();
+    }
+    bool empty() const { return window.empty(); }
+    // p50/p95/p99 of every column since the last report, then starts over
+    void report(FILE* out, const char* gpuMethod) {
+        if (window.empty()) return;
+        double sum = 0; for (const FrameTimes& t : window) sum += t.total;
+        fprintf(out, "%zu frames, %.1f fps        p50      p95      p99 (ms)\n",
+                window.size(), sum>0 ? 1000.0*window.size()/sum : 0.0);
+        row(out, "matrix", &FrameTimes::matrix);
+        row(out, "submit", &FrameTimes::submit);
+        row(out, "gpu", &FrameTimes::gpu, gpuMethod);
+        row(out, "swap", &FrameTimes::swap);
+        row(out, "frame", &FrameTimes::total);
+        row(out, "triangles (count)", &FrameTimes::triangles);
+        row(out, "gl calls (count)", &FrameTimes::glCalls);
+        row(out, "gl calls skipped (count)", &FrameTimes::glSkipped);
+        window.clear();
+    }
+private:
+    void retire(const FrameTimes& t) {
+        window.push_back(t);
+        if (csv) fprintf(csv, "%llu,%.4f,%.4f,%.4f,%.4f,%.4f,%.0f,%.0f,%.0f\n", (unsigned long long)t.frame,
+                         t.matrix, t.submit, t.gpu, t.swap, t.total, t.glCalls, t.glSkipped, t.triangles);
+    }
+    void row(FILE* out, const char* name, double FrameTimes::*col, const char* note=nullptr) {
+        scratch.clear();
+        for (const FrameTimes& t : window) if (t.*col >= 0) scratch.push_back(t.*col);
+        if (scratch.empty()) { fprintf(out, "  %-22s       -\n", name); return; }
+        std::sort(scratch.begin(), scratch.end());
+        auto pct = [&](double p){ return scratch[size_t(p*(scratch.size()-1) + 0.5)]; };
+        fprintf(out, "  %-22s %8.3f %8.3f %8.3f", name, pct(0.50), pct(0.95), pct(0.99));
+        if (note) fprintf(out, "  (%s, %zu samples)", note, scratch.size());
+        fputc('\n', out);
+    }
+    std::deque<FrameTimes> pending;
+    std::vector<FrameTimes> window;
+    std::vector<double> scratch;
+    FILE* csv = nullptr;
+};
+
+// projection and view only change with the viewport, so the frame loop
+// keeps them and rebuilds just the rotation
+struct Camera {
+    Mat4 P, V;
+};
+static float viewDistance = 4.5f;   // --zoom Z divides it
+static Camera makeCamera(int w, int h){
+    float aspect = (h>0) ? (float)w/(float)h : 1.0f;
+    Camera c;
+    c.P = perspective(60.0f*(3.1415926f/180.0f), aspect, 0.1f, 50.0f);
+    c.V = translate(0.0f, 0.0f, -viewDistance);
+    return c;
+}
+// P * V * rotateY(0.9 ang) * rotateX(0.5 ang) without the intermediate
+// matrices, for P from perspective() and V a translation: each column
+// (x,y,z,w) of V*R becomes (P0 x, P5 y, P10 z + P14 w, -z). The products
+// that remain are the ones mul() would form, so the result is the same.
+NO_FP_CONTRACT static Mat4 cameraMVP(const Camera& c, float ang){
+    FP_CONTRACT_OFF
+    const float ca = cosf(ang*0.9f), sa = sinf(ang*0.9f);
+    const float cb = cosf(ang*0.5f), sb = sinf(ang*0.5f);
+    const float vr[4][4] = {
+        { ca, 0.0f, sa, 0.0f },
+        { -sa*sb, cb, ca*sb, 0.0f },
+        { -sa*cb, -sb, ca*cb, 0.0f },
+        { c.V.m[12], c.V.m[13], c.V.m[14], 1.0f },
+    };
+    const float* p = c.P.m;
+    Mat4 M;
+    for (int j=0;j<4;++j){
+        M.m[j*4+0] = p[0]*vr[j][0];
+        M.m[j*4+1] = p[5]*vr[j][1];
+        M.m[j*4+2] = p[10]*vr[j][2] + p[14]*vr[j][3];
+        M.m[j*4+3] = -vr[j][2];
+    }
+    return M;
+}
+static Mat4 buildMVP(int w, int h, float ang){ return cameraMVP(makeCamera(w, h), ang); }
+
+// Rotation angle over time. It follows the wall clock, or advances a fixed
+// simDt per frame (--sim-fps, and --bench at 60) so a run repeats exactly.
+// With fixedDt the angle is updated in steps of that size and the frame
+// shows it interpolated between the last two steps.
+static const double ANG_RATE = 1.2;         // rad/s: 0.02 per frame at 60 Hz
+static const double MAX_FRAME_DT = 0.25;    // a longer stall is not caught up
+class AnimClock {
+public:
+    AnimClock(double simDt, double fixedDt)
+        : simDt(simDt), fixedDt(fixedDt), last(SDL_GetPerformanceCounter()) {}
+    float angle() const {
+        return fixedDt > 0 ? prev + (cur - prev)*float(acc/fixedDt) : cur;
+    }
+    // once per frame, after drawing it
+    void tick() {
+        double dt = simDt;
+        if (dt <= 0) {
+            const Uint64 now = SDL_GetPerformanceCounter();
+            dt = std::min(double(now - last)/double(SDL_GetPerformanceFrequency()), MAX_FRAME_DT);
+            last = now;
+        }
+        if (fixedDt <= 0) { cur += float(ANG_RATE*dt); return; }
+        acc += dt;
+        while (acc >= fixedDt) { prev = cur; cur += float(ANG_RATE*fixedDt); acc -= fixedDt; }
+    }
+private:
+    double simDt, fixedDt;
+    Uint64 last;
+    double acc = 0;
+    float prev = 0, cur = 0;
+};
+
+// Lock-free handoff of the latest T from one writer thread to one reader.
+// The writer fills its back slot and swaps it with the middle one; the
+// reader swaps the middle one with its front slot only when it is fresh.
+// Neither side ever waits, and the reader skips states it was too slow for.
+template <class T>
+class TripleBuffer {
+public:
+    explicit TripleBuffer(const T& init) { slots[0] = slots[1] = slots[2] = init; }
+    void publish(const T& v) {
+        slots[back] = v;
+        back = middle.exchange(back | FRESH) & SLOT;
+    }
+    // true and the newest state if one was published since the last fetch
+    bool fetch(T& out) {
+        if (!(middle.load() & FRESH)) return false;
+        front = middle.exchange(front) & SLOT;
+        out = slots[front];
+        return true;
+    }
+private:
+    static const int SLOT = 3, FRESH = 4;
+    T slots[3];
+    std::atomic<int> middle{1};
+    int back = 0, front = 2;
+};
+
+// what the event loop hands the render thread: everything input can change
+struct InputState {
+    int w, h;               // window size
+    int wantN;              // + / - target resolution
+    ColourMap colourMap;
+    bool quit;
+};
+
+// largest on-screen extent in pixels of the surface's bounding box
+// (x,y in +-1.5, z in [zmin,zmax]); a box crossing the near plane counts as
+// filling the viewport
+static float projectedExtent(const Mat4& MVP, int w, int h, float zmin, float zmax){
+    float x0=1e9f, x1=-1e9f, y0=1e9f, y1=-1e9f;
+    for (int c=0;c<8;++c){
+        const float p[3] = { (c&1) ? 1.5f : -1.5f, (c&2) ? 1.5f : -1.5f, (c&4) ? zmax : zmin };
+        const float* m = MVP.m;
+        float cx = m[0]*p[0] + m[4]*p[1] + m[8]*p[2]  + m[12];
+        float cy = m[1]*p[0] + m[5]*p[1] + m[9]*p[2]  + m[13];
+        float cw = m[3]*p[0] + m[7]*p[1] + m[11]*p[2] + m[15];
+        if (cw <= 1e-6f) return float(w>h ? w : h);
+        cx = (cx/cw*0.5f + 0.5f)*w; cy = (cy/cw*0.5f + 0.5f)*h;
+        x0 = fminf(x0,cx); x1 = fmaxf(x1,cx); y0 = fminf(y0,cy); y1 = fmaxf(y1,cy);
+    }
+    return fmaxf(x1-x0, y1-y0);
+}
+
+// Meshes for LOD_SIZES, built the first time their level is picked. The
+// wanted N is the projected extent over LOD_PIXELS_PER_CELL; the chain moves
+// up only once that exceeds the current N by LOD_HYSTERESIS, and down only
+// once it is that far below the next smaller N, so coverage hovering near a
+// boundary does not flip levels every frame.
+static const int LOD_LEVELS = 5;
+static const int LOD_SIZES[LOD_LEVELS] = { 64, 128, 256, 512, 1024 };
+static const float LOD_PIXELS_PER_CELL = 4.0f;
+static const float LOD_HYSTERESIS = 0.15f;
+
+// With an async builder a level that is not built yet is requested in the
+// background and the level on screen stays until adopt() delivers it; only
+// the very first level is built in place.
+class LodChain {
+public:
+    explicit LodChain(std::function<Mesh(int N)> build, MeshBuilder* async=nullptr)
+        : build(build), async(async) {}
+    void destroy() { for (Mesh& m : meshes) if (m.vbo) destroyMesh(m); }
+    int level() const { return shown; }
+    void adopt(int level, Mesh& m) { meshes[level] = std::move(m); pending = -1; }
+    // highest level select() may pick (the quality controller lowers it)
+    void setMaxLevel(int level) { maxLevel = level; }
+
+    Mesh& select(const Mat4& MVP, int w, int h, float zmin, float zmax) {
+        const float want = projectedExtent(MVP, w, h, zmin, zmax) / LOD_PIXELS_PER_CELL;
+        int ideal = 0;
+        while (ideal < maxLevel && float(LOD_SIZES[ideal]) < want) ++ideal;
+        if (cur < 0 || cur > maxLevel) cur = ideal;
+        else if (ideal > cur && want > LOD_SIZES[cur]*(1.0f+LOD_HYSTERESIS)) cur = ideal;
+        else if (ideal < cur && want < LOD_SIZES[cur-1]*(1.0f-LOD_HYSTERESIS)) cur = ideal;
+        if (!meshes[cur].vbo) {
+            if (!async || shown < 0) meshes[cur] = build(LOD_SIZES[cur]);
+            else if (pending < 0 && async->idle()) {
+                pending = cur;
+                const int n = LOD_SIZES[cur];
+                // a copy of build: the job may outlive this chain at exit,
+                // since the builder is destroyed after it
+                async->submit(cur, [build = build, n]{ return build(n); });
+            }
+        }
+        if (meshes[cur].vbo) shown = cur;
+        return meshes[shown];
+    }
+
+private:
+    std::function<Mesh(int N)> build;
+    MeshBuilder* async;
+    Mesh meshes[LOD_LEVELS];
+    int cur = -1, shown = -1, pending = -1;
+    int maxLevel = LOD_LEVELS-1;
+};
+
+// --budget: holds the smoothed frame time near a budget by walking one
+// quality ladder, render scale first (cheap to change, and fill rate is what
+// a software rasterizer runs out of), then mesh detail, halving N per step.
+// Over budget it steps down; well under it steps up. Vsync hides headroom,
+// so after PROBE_MIN frames inside the budget it also tries one step up,
+// and a probe that has to be undone doubles the wait before the next one.
+class QualityController {
+public:
+    static constexpr int DETAIL_STEPS = 3;      // down to N/8
+    static constexpr float OVER = 1.10f, UNDER = 0.70f, ALPHA = 0.1f;
+    static constexpr int COOLDOWN = 30;         // frames to settle after a change
+    static constexpr int PROBE_MIN = 120, PROBE_MAX = 1920;
+    // a budget of 0 leaves the controller at full quality
+    explicit QualityController(double budgetMs) : budget(budgetMs) {}
+    // once per frame with its full time; true when scale() or detail() changed
+    bool update(double frameMs) {
+        if (budget <= 0) return false;
+        ema = ema > 0 ? ema + ALPHA*(frameMs - ema) : frameMs;
+        if (++sinceChange < COOLDOWN) return false;
+        if (ema > budget*OVER && q < STEPS-1) {
+            if (probed) probeWait = std::min(2*probeWait, PROBE_MAX);
+            return step(+1, false);
+        }
+        if (q > 0 && ema < budget*UNDER) { probeWait = PROBE_MIN; return step(-1, false); }
+        if (q > 0 && sinceChange >= probeWait) return step(-1, true);
+        return false;
+    }
+    float scale() const { return SCALES[std::min(q, SCALE_STEPS-1)]; }
+    int detail() const { return std::max(0, q - (SCALE_STEPS-1)); }
+    double smoothedMs() const { return ema; }
+private:
+    static constexpr int SCALE_STEPS = 5;
+    static constexpr float SCALES[SCALE_STEPS] = { 1.0f, 0.85f, 0.7f, 0.6f, 0.5f };
+    static constexpr int STEPS = SCALE_STEPS + DETAIL_STEPS;
+    bool step(int d, bool probe) { q += d; probed = probe; sinceChange = 0; return true; }
+    double budget, ema = 0;
+    int q = 0, sinceChange = 0, probeWait = PROBE_MIN;
+    bool probed = false;
+};
+
+// ft, when given, receives the draw-submission time; inst draws the mesh
+// as an instanced wall, and a scene is drawn instead of the mesh
+static void renderFrame(const Program& prog, Mesh& mesh, const Mat4& MVP,
+                        FrameTimes* ft=nullptr, InstanceSet* inst=nullptr, Scene* scene=nullptr){
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    const uint64_t calls0 = glState.calls, skipped0 = glState.skipped;
+    clearColor(0.02f,0.02f,0.03f,1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    countCalls();
+
+    if (scene) drawScene(*scene, MVP);
+    else {
+        useProgram(prog.id);
+        setMVP(prog, MVP.m);
+        // instances are placed by their own model matrices, so only a lone
+        // surface is culled
+        if (inst) uploadInstanceMVPs(*inst, MVP);
+        else if (!mesh.tiles.empty()) cullTiles(mesh, MVP);
+        drawMesh(mesh, prog, inst);
+    }
+    if (ft) {
+        ft->submit = msSince(t0);
+        ft->triangles = double(scene ? scene->triangles : drawnTriangles(mesh, inst));
+        ft->glCalls = double(glState.calls - calls0);
+        ft->glSkipped = double(glState.skipped - skipped0);
+    }
+}
+
+// --microbench: timings for comparing commits and machines, as JSON. Each
+// case repeats for at least MICROBENCH_MS after one untimed run and reports
+// the mean.
+static const double MICROBENCH_MS = 300.0;
+static const int MICROBENCH_SIZES[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+
+// ms per makeSombrero, staged so no GL upload is included; inline runs it
+// on this thread only
+static double benchGenerate(int N, const MeshOptions& o, bool inlineEval, int& reps){
+    MeshStaging st;
+    st.arena = &glArena;
+    evalInline = inlineEval;
+    auto once = [&]{
+        meshStaging = &st;
+        makeSombrero(N, 6.0f, 1.0f, 1.0f, o);
+        meshStaging = nullptr;
+        st.buffers.clear();
+        glArena.reset();
+    };
+    once();
+    const Uint64 t0 = SDL_GetPerformanceCounter();
+    for (reps = 0; reps == 0 || msSince(t0) < MICROBENCH_MS; ++reps) once();
+    evalInline = false;
+    return msSince(t0)/reps;
+}
+
+// ns per call of fn over a spread of angles; the results are summed into a
+// volatile so none of the calls can be dropped
+static volatile float benchSink;
+template<class F>
+static double benchMat4(F&& fn){
+    float acc = 0;
+    const int BATCH = 4096;
+    for (int i=0; i<BATCH; ++i) acc += fn(i).m[i & 15];
+    const Uint64 t0 = SDL_GetPerformanceCounter();
+    long calls = 0;
+    while (calls == 0 || msSince(t0) < MICROBENCH_MS) {
+        for (int i=0; i<BATCH; ++i) acc += fn(i).m[i & 15];
+        calls += BATCH;
+    }
+    benchSink = acc;
+    return msSince(t0)*1e6/double(calls);
+}
+
+// quotes and backslashes escaped; driver strings have nothing else to fear
+static std::string jsonString(const char* s){
+    std::string r = "\"";
+    for (; s && *s; ++s){ if (*s == '"' || *s == '\\') r += '\\'; r += *s; }
+    return r + "\"";
+}
+
+int main(int argc, char** argv){
+    int N = 128;
+    bool allowUint = true;
+    bool gpuEval = false;
+    bool animate = false;
+    bool lit = false;
+    bool lut = false;
+    ColourMap colourMap = MAP_RAMP;
+    int benchTopology = 0;
+    bool simdKernel = true;
+    bool stats = false;
+    const char* csvPath = nullptr;
+    bool gpuFinish = false;
+    int benchFrames = 0;
+    bool offscreen = false;
+    bool lod = false;
+    const char* cacheDir = nullptr;
+    int instanceCount = 0;
+    int sceneCount = 0;
+    const char* microbenchPath = nullptr;
+    bool allowES3 = true;
+    double simFps = 0, fixedHz = 0;
+    const char* capturePath = nullptr;
+    CaptureFormat captureFormat = CAPTURE_PPM;
+    int frameLimit = 0;
+    double budgetMs = 0;
+    int w=900,h=700;
+    MeshOptions meshOpt;
+    for (int a=1; a<argc; ++a){
+        if (!strcmp(argv[a],"-n") && a+1<argc) N = atoi(argv[++a]);
+        else if (!strcmp(argv[a],"--no-uint")) allowUint = false;
+        else if (!strcmp(argv[a],"--gpu")) gpuEval = true;
+        else if (!strcmp(argv[a],"--animate")) animate = true;
+        else if (!strcmp(argv[a],"--lit")) lit = true;
+        else if (!strcmp(argv[a],"--lut")) lut = true;
+        else if (!strcmp(argv[a],"--colormap") && a+1<argc) {
+            const char* t = argv[++a];
+            int k=0; while (k<MAP_COUNT && strcmp(t, colourMapNames[k])) ++k;
+            if (k==MAP_COUNT) { fprintf(stderr,"unknown colour map '%s'\n", t); return 1; }
+            colourMap = ColourMap(k);
+            lut = true;
+        }
+        else if (!strcmp(argv[a],"--half")) meshOpt.halfPos = true;
+        else if (!strcmp(argv[a],"--radial")) meshOpt.radial = true;
+        else if (!strcmp(argv[a],"--cache") && a+1<argc) cacheDir = argv[++a];
+        else if (!strcmp(argv[a],"--topology") && a+1<argc) {
+            const char* t = argv[++a];
+            int k=0; while (k<TOPO_COUNT && strcmp(t, topologyNames[k])) ++k;
+            if (k==TOPO_COUNT) { fprintf(stderr,"unknown topology '%s'\n", t); return 1; }
+            meshOpt.topology = Topology(k);
+        }
+        else if (!strcmp(argv[a],"--bench-topology") && a+1<argc) benchTopology = atoi(argv[++a]);
+        else if (!strcmp(argv[a],"--threads") && a+1<argc) workerThreads = atoi(argv[++a]);
+        else if (!strcmp(argv[a],"--full-eval")) mirrorEval = false;
+        else if (!strcmp(argv[a],"--stats")) stats = true;
+        else if (!strcmp(argv[a],"--csv") && a+1<argc) csvPath = argv[++a];
+        else if (!strcmp(argv[a],"--gpu-finish")) gpuFinish = true;
+        else if (!strcmp(argv[a],"--bench") && a+1<argc) benchFrames = atoi(argv[++a]);
+        else if (!strcmp(argv[a],"--offscreen")) offscreen = true;
+        else if (!strcmp(argv[a],"--capture") && a+1<argc) capturePath = argv[++a];
+        else if (!strcmp(argv[a],"--capture-format") && a+1<argc) {
+            const char* f = argv[++a];
+            if (!strcmp(f,"ppm")) captureFormat = CAPTURE_PPM;
+            else if (!strcmp(f,"y4m")) captureFormat = CAPTURE_Y4M;
+            else { fprintf(stderr,"unknown capture format '%s'\n", f); return 1; }
+        }
+        else if (!strcmp(argv[a],"--frames") && a+1<argc) frameLimit = atoi(argv[++a]);
+        else if (!strcmp(argv[a],"--budget") && a+1<argc) {
+            budgetMs = atof(argv[++a]);
+            if (!(budgetMs > 0)) { fprintf(stderr,"--budget needs MS > 0\n"); return 1; }
+        }
+        else if (!strcmp(argv[a],"--lod")) lod = true;
+        else if (!strcmp(argv[a],"--gles2")) allowES3 = false;
+        else if ((!strcmp(argv[a],"--sim-fps") || !strcmp(argv[a],"--fixed-step")) && a+1<argc) {
+            const bool sim = !strcmp(argv[a],"--sim-fps");
+            const double hz = atof(argv[++a]);
+            if (!(hz > 0)) { fprintf(stderr,"%s needs a rate > 0\n", argv[a-1]); return 1; }
+            (sim ? simFps : fixedHz) = hz;
+        }
+        else if (!strcmp(argv[a],"--zoom") && a+1<argc) {
+            const float z = float(atof(argv[++a]));
+            if (!(z > 0.0f)) { fprintf(stderr,"--zoom needs Z > 0\n"); return 1; }
+            viewDistance /= z;
+        }
+        else if (!strcmp(argv[a],"--instances") && a+1<argc) {
+            instanceCount = atoi(argv[++a]);
+            if (instanceCount < 1) { fprintf(stderr,"--instances needs K >= 1\n"); return 1; }
+        }
+        else if (!strcmp(argv[a],"--microbench") && a+1<argc) microbenchPath = argv[++a];
+        else if (!strcmp(argv[a],"--scene") && a+1<argc) {
+            sceneCount = atoi(argv[++a]);
+            if (sceneCount < 1) { fprintf(stderr,"--scene needs K >= 1\n"); return 1; }
+        }
+        else if (!strcmp(argv[a],"--size") && a+1<argc) {
+            if (sscanf(argv[++a], "%dx%d", &w, &h) != 2 || w<1 || h<1) {
+                fprintf(stderr,"bad size '%s', expected WxH\n", argv[a]); return 1;
+            }
+        }
+        else if (!strcmp(argv[a],"--surface") && a+1<argc) {
+            const char* t = argv[++a];
+            int k=0; while (k<SURFACE_COUNT && strcmp(t, SURFACES[k].name)) ++k;
+            if (k==SURFACE_COUNT) { fprintf(stderr,"unknown surface '%s'\n", t); return 1; }
+            currentSurface = &SURFACES[k];
+        }
+        else if (!strcmp(argv[a],"--kernel") && a+1<argc) {
+            const char* k = argv[++a];
+            if (!strcmp(k,"scalar")) simdKernel = false;
+            else if (!strcmp(k,"simd")) simdKernel = true;
+            else { fprintf(stderr,"unknown kernel '%s'\n", k); return 1; }
+        }
+        else {
+            fprintf(stderr,"usage: %s [-n N] [--no-uint] [--gpu] [--animate] [--lit] [--lut] [--colormap ramp|heat|gray] [--half]\n"
+                           "          [--topology list|strip|blocked|tiled] [--bench-topology FRAMES] [--threads T]\n"
+                           "          [--kernel scalar|simd] [--full-eval] [--stats] [--csv FILE] [--gpu-finish]\n"
+                           "          [--bench FRAMES] [--microbench FILE|-] [--offscreen] [--size WxH] [--lod] [--radial]\n"
+                           "          [--cache DIR] [--instances K] [--scene K] [--gles2] [--surface sombrero|gaussian|ripple]\n"
+                           "          [--zoom Z] [--sim-fps F] [--fixed-step HZ] [--frames F] [--budget MS]\n"
+                           "          [--capture FILE|-|'|COMMAND'] [--capture-format ppm|y4m]\n", argv[0]);
+            return 1;
+        }
+    }
+    // the scene packs static CPU grids
+    if (sceneCount) {
+        if (instanceCount) { fprintf(stderr,"--scene ignores --instances\n"); instanceCount = 0; }
+        if (lod) { fprintf(stderr,"--scene ignores --lod\n"); lod = false; }
+        if (gpuEval) { fprintf(stderr,"--scene builds CPU meshes; ignoring --gpu\n"); gpuEval = false; }
+        if (animate) { fprintf(stderr,"--scene meshes are static; ignoring --animate\n"); animate = false; }
+        if (meshOpt.radial) { fprintf(stderr,"--scene uses the grid; ignoring --radial\n"); meshOpt.radial = false; }
+        // joined strips would run into each other when merged
+        if (meshOpt.topology == TOPO_STRIP) { fprintf(stderr,"--scene draws triangle lists; ignoring --topology strip\n"); meshOpt.topology = TOPO_LIST; }
+    }
+    // the wall shares one GPU_EVAL grid; a single LOD would not fit K sizes
+    if (instanceCount && lod) { fprintf(stderr,"--instances ignores --lod\n"); lod = false; }
+    if (instanceCount) gpuEval = true;
+    if (microbenchPath) offscreen = true;
+    // a recording is rendered at its own size and pace, not the display's
+    if (capturePath) {
+        offscreen = true;
+        if (simFps <= 0) simFps = 60;
+    }
+    // ring spacing and ring evaluation are worked out for sin(r)/r
+    if (meshOpt.radial && currentSurface != &SURFACES[0] && !gpuEval) {
+        fprintf(stderr,"--radial supports only the sombrero; using the grid\n");
+        meshOpt.radial = false;
+    }
+    meshOpt.dynamic = animate && !gpuEval;
+    meshOpt.lut = lut && !gpuEval;
+    selectRowKernel(simdKernel);
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr,"SDL_Init: %s\n", SDL_GetError()); return 1;
+    }
+
+    // Request a GLES 3.0 context, 2.0 if that fails (or with --gles2)
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, allowES3 ? 3 : 2);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+    SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+
+    SDL_Window* win = SDL_CreateWindow(
+        "Spinning Sombrero (SDL2 + GLES 3 / GLES 2 fallback)",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        w, h, SDL_WINDOW_OPENGL | (offscreen ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE));
+    if (!win){ fprintf(stderr,"SDL_CreateWindow: %s\n", SDL_GetError()); return 1; }
+
+    SDL_GLContext ctx = SDL_GL_CreateContext(win);
+    if (!ctx && allowES3) {
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
+        ctx = SDL_GL_CreateContext(win);
+    }
+    if (!ctx){ fprintf(stderr,"SDL_GL_CreateContext: %s\n", SDL_GetError()); return 1; }
+    // --budget asks for adaptive vsync where the driver has it: a late frame
+    // tears instead of waiting a whole extra interval
+    if (benchFrames > 0) SDL_GL_SetSwapInterval(0);
+    else if (budgetMs <= 0 || SDL_GL_SetSwapInterval(-1) != 0) SDL_GL_SetSwapInterval(1);
+
+    detectCaps(allowUint, allowES3);
+    // attributes are bound to fixed locations (aPos/aGrid=0, aCol=1)
+    const std::string defines = std::string("#define SURFACE_Z(r, zs, fr) ") + currentSurface->glsl + "\n"
+        + "#define SURFACE_DZ(r, zs, fr) " + currentSurface->glslDz + "\n" + (lit ? "#define LIT\n" : "") + (lut ? "#define LUT\n" : "")
+        + (instanceCount ? "#define GPU_EVAL\n#define INSTANCED\n" : gpuEval ? "#define GPU_EVAL\n" : "");
+    Program prog = makeProgram(defines.c_str());
+    prog.lit = lit;
+    prog.lut = lut;
+    if (stats) printf("context: %s (%s%s)\n", (const char*)glGetString(GL_VERSION),
+                      caps.es3 ? "GLSL 3.00, uniform block" : "GLSL 1.00",
+                      caps.vertexArray ? ", vertex arrays" : "");
+    auto generateMesh = [&](int n, const MeshOptions& o){
+        return gpuEval  ? makeSombreroGrid(n, 6.0f, 1.0f, 1.0f, o)
+             : o.radial ? makeSombreroRadial(n, 6.0f, 1.0f, 1.0f, o)
+                        : makeSombrero(n, 6.0f, 1.0f, 1.0f, o);
+    };
+    // dynamic meshes are rewritten every frame, so only static ones are cached
+    auto buildMesh = [&](int n, const MeshOptions& o){
+        if (!cacheDir || o.dynamic) return generateMesh(n, o);
+        const MeshCacheKey key = meshCacheKey(n, 6.0f, 1.0f, 1.0f, o, gpuEval);
+        const std::string path = meshCachePath(cacheDir, key);
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        Mesh m;
+        if (loadMeshCache(path, key, m)) {
+            if (stats) printf("mesh cache: loaded %s in %.1f ms\n", path.c_str(), msSince(t0));
+            return m;
+        }
+        // a background build is already staged; otherwise stage here so the
+        // bytes can be written out, then upload them in one go
+        MeshStaging local;
+        local.arena = &glArena;
+        MeshStaging* st = meshStaging ? meshStaging : &local;
+        meshStaging = st;
+        m = generateMesh(n, o);
+        if (stats) printf("mesh cache: built N=%d in %.1f ms\n", m.N, msSince(t0));
+        if (!saveMeshCache(path, key, m, st->buffers))
+            fprintf(stderr,"mesh cache: cannot write %s\n", path.c_str());
+        if (st == &local) { meshStaging = nullptr; uploadStaged(m, local, 0.0); glArena.reset(); }
+        return m;
+    };
+    if (meshOpt.radial && gpuEval)
+        fprintf(stderr,"--radial has no GPU_EVAL path; using the grid\n");
+    if (meshOpt.radial && meshOpt.topology != TOPO_LIST)
+        fprintf(stderr,"--radial meshes are triangle lists; ignoring --topology\n");
+    if (meshOpt.halfPos && !caps.halfFloat && !gpuEval)
+        fprintf(stderr,"OES_vertex_half_float not available; using float positions\n");
+
+    // offscreen: the hidden window's default framebuffer is undefined, so
+    // everything goes to an FBO of the requested size
+    Framebuffer target;
+    if (offscreen && !makeFramebuffer(target, w, h)) {
+        fprintf(stderr,"offscreen framebuffer incomplete\n"); return 1;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glViewport(0,0,w,h);
+    glEnable(GL_DEPTH_TEST);
+    const GLuint lutTex = lut ? makeColourLut(colourMap) : 0;    // stays bound
+    FrameCapture capture;
+    if (capturePath && !capture.open(capturePath, captureFormat, w, h, simFps)) {
+        fprintf(stderr,"cannot write %s\n", capturePath); return 1;
+    }
+
+    // --budget: the scene goes to `scaled` when the controller lowers the
+    // render scale and is stretched over the target afterwards
+    QualityController quality(budgetMs);
+    Framebuffer scaled;
+    Upscaler upscaler;
+    if (budgetMs > 0) upscaler = makeUpscaler();
+
+    InstanceSet instances;
+    InstanceSet* wall = instanceCount ? &instances : nullptr;
+
+    if (benchTopology > 0) {
+        // same camera path for every ordering; glFinish so each run is timed
+        // to completion rather than to the end of submission
+        SDL_GL_SetSwapInterval(0);
+        printf("N=%d %s\n%-8s %10s %12s %10s\n", N, gpuEval ? "gpu" : "cpu",
+               "topology", "indices", "index bytes", "ms/frame");
+        for (int t=0; t<TOPO_COUNT; ++t){
+            MeshOptions o = meshOpt; o.topology = Topology(t);
+            Mesh bm = buildMesh(N, o);
+            if (wall) writeInstances(instances, instanceCount, bm.N, 6.0f, false, 0.0f);
+            renderFrame(prog, bm, buildMVP(w, h, 0.0f), nullptr, wall); glFinish();
+            Uint64 t0 = SDL_GetPerformanceCounter();
+            for (int f=0; f<benchTopology; ++f){
+                renderFrame(prog, bm, buildMVP(w, h, f*0.02f), nullptr, wall);
+                SDL_GL_SwapWindow(win);
+            }
+            glFinish();
+            double ms = 1000.0*double(SDL_GetPerformanceCounter()-t0)/double(SDL_GetPerformanceFrequency());
+            printf("%-8s %10d %12zu %10.3f\n", topologyNames[t], bm.indexCount, indexBytes(bm), ms/benchTopology);
+            destroyMesh(bm);
+        }
+        if (wall) destroyInstances(instances);
+        destroyProgram(prog);
+        SDL_GL_DeleteContext(ctx);
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 0;
+    }
+
+    if (microbenchPath) {
+        FILE* out = strcmp(microbenchPath, "-") ? fopen(microbenchPath, "w") : stdout;
+        if (!out) { fprintf(stderr,"cannot write %s\n", microbenchPath); return 1; }
+        SDL_GL_SetSwapInterval(0);
+        selectRowKernel(true);
+        fprintf(out, "{\n  \"machine\": {\"cpus\": %d, \"threads\": %d, \"simd\": \"%s\", \"gl_version\": %s, \"gl_renderer\": %s},\n",
+                SDL_GetCPUCount(), workerThreads > 0 ? workerThreads : int(std::thread::hardware_concurrency()), rowKernelName,
+                jsonString((const char*)glGetString(GL_VERSION)).c_str(), jsonString((const char*)glGetString(GL_RENDERER)).c_str());
+
+        struct Variant { const char* name; bool simd, inlineEval; };
+        static const Variant variants[] = { {"scalar", false, true}, {"simd", true, true}, {"threaded", true, false} };
+        MeshOptions o = meshOpt;
+        o.dynamic = false;
+        fprintf(out, "  \"generate\": [");
+        const char* sep = "\n";
+        for (int n : MICROBENCH_SIZES)
+            for (const Variant& v : variants){
+                selectRowKernel(v.simd);
+                int reps;
+                const double ms = benchGenerate(n, o, v.inlineEval, reps);
+                fprintf(out, "%s    {\"N\": %d, \"variant\": \"%s\", \"kernel\": \"%s\", \"ms\": %.4f, \"mvertices_per_s\": %.2f, \"reps\": %d}",
+                        sep, n, v.name, rowKernelName, ms, double(n)*n/(ms*1e3), reps);
+                sep = ",\n";
+            }
+        selectRowKernel(simdKernel);
+
+        const Camera cam = makeCamera(w, h);
+        const Mat4 A = cameraMVP(cam, 0.3f), B = rotateY(0.7f);
+        fprintf(out, "\n  ],\n  \"mat4_ns\": {\"mul\": %.3f, \"perspective\": %.3f, \"rotateX\": %.3f, \"rotateY\": %.3f, \"cameraMVP\": %.3f},\n",
+                benchMat4([&](int i){ Mat4 b = B; b.m[12] = float(i); return mul(A, b); }),
+                benchMat4([](int i){ return perspective(0.8f + i*1e-6f, 1.3f, 0.1f, 100.0f); }),
+                benchMat4([](int i){ return rotateX(i*1e-3f); }),
+                benchMat4([](int i){ return rotateY(i*1e-3f); }),
+                benchMat4([&](int i){ return cameraMVP(cam, i*1e-3f); }));
+
+        // whole frames into the offscreen target: submit is the CPU side,
+        // frames/s includes the GPU through the closing glFinish
+        Mesh fm = buildMesh(N, meshOpt);
+        if (wall) writeInstances(instances, instanceCount, fm.N, 6.0f, false, 0.0f);
+        renderFrame(prog, fm, buildMVP(w, h, 0.0f), nullptr, wall); glFinish();
+        double submit = 0;
+        int frames = 0;
+        const Uint64 t0 = SDL_GetPerformanceCounter();
+        for (; frames < 10 || msSince(t0) < 3*MICROBENCH_MS; ++frames){
+            FrameTimes ft;
+            renderFrame(prog, fm, buildMVP(w, h, frames*0.02f), &ft, wall);
+            submit += ft.submit;
+        }
+        glFinish();
+        const double sec = msSince(t0)*1e-3;
+        fprintf(out, "  \"frame\": {\"N\": %d, \"%s\": %d, \"width\": %d, \"height\": %d, \"triangles\": %zu, \"frames\": %d, \"fps\": %.2f, \"submit_ms\": %.4f}\n}\n",
+                fm.N, wall ? "instances" : "surfaces", wall ? instanceCount : 1, w, h, drawnTriangles(fm, wall),
+                frames, frames/sec, submit/frames);
+        if (out != stdout) fclose(out);
+        destroyMesh(fm);
+        if (wall) destroyInstances(instances);
+        if (lutTex) glDeleteTextures(1, &lutTex);
+        if (upscaler.program) destroyUpscaler(upscaler);
+        destroyFramebuffer(target);
+        destroyProgram(prog);
+        SDL_GL_DeleteContext(ctx);
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 0;
+    }
+
+    // with --lod the fixed mesh stays empty and the chain supplies one per frame
+    Mesh mesh = (lod || sceneCount) ? Mesh() : buildMesh(N, meshOpt);
+    if (lod) surfaceRange(LOD_SIZES[LOD_LEVELS-1], 6.0f, 1.0f, 1.0f, mesh.zmin, mesh.zmax);
+    // later builds (LOD levels, +/- keys) run in the background
+    MeshBuilder builder;
+    const int REBUILD_MESH = -1;    // builder tag; LOD levels use their index
+    int wantN = N, buildingN = N;
+    LodChain lodChain([&](int n){ return buildMesh(n, meshOpt); }, &builder);
+    if (stats && mesh.vbo) printf("mesh: N=%d, %zu vertices, %zu triangles\n", mesh.N, mesh.vertices, mesh.triangles);
+    Scene scene;
+    Scene* drawn = sceneCount ? &scene : nullptr;
+    auto buildScene = [&](int n){
+        if (scene.N) destroyScene(scene);
+        scene = makeScene(sceneCount, n, 6.0f, prog, meshOpt);
+        if (stats) printf("scene: %d surfaces at N=%d in %zu buffer(s), %zu draw call(s), %zu triangles\n",
+                          sceneCount, scene.N, scene.buffers.size(), sceneDrawCalls(scene), scene.triangles);
+    };
+    if (drawn) buildScene(N);
+    if (wall) {
+        writeInstances(instances, instanceCount, mesh.N, 6.0f, animate, 0.0f);
+        if (stats) printf("instances: %d in %zu draw call(s) via %s\n", instanceCount,
+                          instanceDrawCalls(mesh, instances), caps.instanced ? ext.instancedApi : "constant attributes");
+    }
+    float zscale = 1.0f, freq = 1.0f;
+    size_t benchTriangles = 0;
+    int lodShown = -1;
+
+    // timing is only taken when someone asked for it
+    const bool timed = stats || csvPath;
+    FrameStats frameStats;
+    GpuTimer gpuTimer;
+    if (csvPath && !frameStats.openCsv(csvPath)) {
+        fprintf(stderr,"cannot write %s\n", csvPath); return 1;
+    }
+    if (timed) gpuTimer.init(gpuFinish);
+    uint64_t frame = 0;
+    Uint64 lastReport = SDL_GetPerformanceCounter();
+    // largest transient build memory so far: it is what each arena now holds
+    auto reportScratch = [&]{
+        printf("  scratch high-water: %.2f MiB on the GL thread, %.2f MiB in the builder\n",
+               glArena.highWaterBytes()/1048576.0, builder.scratchHighWater()/1048576.0);
+    };
+
+    // one untimed frame so shader and buffer warm-up stay out of the numbers
+    Uint64 benchStart = 0;
+    if (benchFrames > 0) {
+        Mat4 MVP = buildMVP(w, h, 0.0f);
+        renderFrame(prog, lod ? lodChain.select(MVP, w, h, mesh.zmin, mesh.zmax) : mesh, MVP, nullptr, wall, drawn);
+        glFinish();
+        benchStart = SDL_GetPerformanceCounter();
+    }
+
+    // The render thread owns the context from here on and draws as fast as
+    // the swap lets it; this thread only handles events, so input is taken
+    // at the same rate however long a swap blocks (VNC, software GL).
+    InputState input = { w, h, N, colourMap, false };
+    TripleBuffer<InputState> inputs(input);
+    std::atomic<bool> rendering{true};
+    bool quit=false;
+    AnimClock clock(simFps > 0 ? 1.0/simFps : benchFrames > 0 ? 1.0/60 : 0.0,
+                    fixedHz > 0 ? 1.0/fixedHz : 0.0);
+    Camera camera = makeCamera(w, h);
+
+    auto renderLoop = [&]{
+        SDL_GL_MakeCurrent(win, ctx);
+        while(!quit){
+            Uint64 tFrame = SDL_GetPerformanceCounter();
+            InputState in;
+            if (inputs.fetch(in)) {
+                quit = in.quit;
+                if (in.w != w || in.h != h) {
+                    w = in.w; h = in.h;
+                    glViewport(0,0,w,h);
+                    camera = makeCamera(w, h);
+                }
+                wantN = in.wantN;
+                if (in.colourMap != colourMap) {
+                    colourMap = in.colourMap;
+                    setColourMap(lutTex, colourMap);
+                    if (stats) printf("colour map: %s\n", colourMapNames[colourMap]);
+                }
+            }
+
+            // the old mesh is drawn until its replacement is fully uploaded; each
+            // detail step halves N, but never below what the keys asked for or 16.
+            // Under --lod the fixed mesh is never drawn: detail only lowers the
+            // chain's top level (setMaxLevel below)
+            const int detailN = std::max(wantN >> quality.detail(), std::min(wantN, 16));
+            // the scene is repacked in place, which stalls this one frame
+            if (drawn && detailN != buildingN) { buildingN = detailN; buildScene(detailN); }
+            if (!drawn && !lod && detailN != buildingN && builder.idle()) {
+                buildingN = detailN;
+                builder.submit(REBUILD_MESH, [&buildMesh, &meshOpt, detailN]{ return buildMesh(detailN, meshOpt); });
+            }
+            Mesh built;
+            int builtTag = 0;
+            if (builder.poll(built, builtTag)) {
+                if (builtTag == REBUILD_MESH) {
+                    destroyMesh(mesh);
+                    mesh = std::move(built);
+                    if (stats) printf("mesh: N=%d, %zu vertices, %zu triangles\n", mesh.N, mesh.vertices, mesh.triangles);
+                    if (wall && !animate) writeInstances(instances, instanceCount, mesh.N, 6.0f, false, 0.0f);
+                }
+                else lodChain.adopt(builtTag, built);
+            }
+
+            FrameTimes ft;
+            ft.frame = frame;
+            Uint64 tMatrix = SDL_GetPerformanceCounter();
+            const float ang = clock.angle();
+            Mat4 MVP = cameraMVP(camera, ang);
+            ft.matrix = msSince(tMatrix);
+
+            if (animate) { zscale = 1.0f + 0.3f*sinf(ang*1.1f); freq = 1.0f + 0.5f*sinf(ang*0.7f); }
+            // render size: the target's, or the controller's fraction of it
+            const float rs = quality.scale();
+            const int rw = std::max(1, int(w*rs + 0.5f)), rh = std::max(1, int(h*rs + 0.5f));
+            const bool upscaled = rw != w || rh != h;
+            if (upscaled && (scaled.w != rw || scaled.h != rh)) {
+                if (scaled.fbo) destroyFramebuffer(scaled);
+                glActiveTexture(GL_TEXTURE1);    // unit 0 keeps the LUT
+                if (!makeFramebuffer(scaled, rw, rh)) fprintf(stderr,"scaled framebuffer incomplete\n");
+                glActiveTexture(GL_TEXTURE0);
+            }
+            if (upscaled) { glBindFramebuffer(GL_FRAMEBUFFER, scaled.fbo); glViewport(0,0,rw,rh); }
+            Mesh* active = &mesh;
+            if (lod) {
+                lodChain.setMaxLevel(LOD_LEVELS-1 - quality.detail());
+                active = &lodChain.select(MVP, rw, rh, mesh.zmin, mesh.zmax);
+                if (stats && lodChain.level() != lodShown) printf("lod: N=%d\n", active->N);
+                lodShown = lodChain.level();
+                // the full-surface range keeps the box stable across levels
+                mesh.zmin = active->zmin; mesh.zmax = active->zmax;
+            }
+            if (!drawn && (active->zscale != zscale || active->freq != freq))
+                updateSombrero(*active, zscale, freq);
+            if (wall && animate) writeInstances(instances, instanceCount, mesh.N, 6.0f, true, ang);
+            if (timed) gpuTimer.begin(frame);
+            renderFrame(prog, *active, MVP, timed ? &ft : nullptr, wall, drawn);
+            if (upscaled) {
+                glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+                glViewport(0,0,w,h);
+                upscale(upscaler, scaled);
+            }
+            benchTriangles += drawn ? scene.triangles : drawnTriangles(*active, wall);
+            if (timed) {
+                frameStats.push(ft);
+                gpuTimer.end([&](uint64_t f, double ms){ frameStats.setGpu(f, ms); });
+            }
+            if (capture.active()) {
+                capture.grab();
+                if (capture.failed()) { fprintf(stderr,"capture: write to %s failed\n", capturePath); quit = true; }
+            }
+
+            Uint64 tSwap = SDL_GetPerformanceCounter();
+            if (!offscreen) SDL_GL_SwapWindow(win);
+            clock.tick();
+
+            if (quality.update(msSince(tFrame)) && stats)
+                printf("quality: scale %.2f, detail -%d (frame %.1f ms)\n",
+                       quality.scale(), quality.detail(), quality.smoothedMs());
+            if (timed) {
+                // the row was queued above; fill in the parts measured after it
+                FrameTimes& last = frameStats.back();
+                last.swap = msSince(tSwap);
+                last.total = msSince(tFrame);
+                if (stats && msSince(lastReport) >= 5000.0) {
+                    frameStats.report(stdout, gpuTimer.method());
+                    reportScratch();
+                    lastReport = SDL_GetPerformanceCounter();
+                }
+            }
+            ++frame;
+            if (benchFrames > 0 && frame >= uint64_t(benchFrames)) quit = true;
+            if (frameLimit > 0 && frame >= uint64_t(frameLimit)) quit = true;
+        }
+        // hand the context back and wake the event loop
+        SDL_GL_MakeCurrent(win, nullptr);
+        rendering = false;
+        SDL_Event done = {};
+        done.type = SDL_USEREVENT;
+        SDL_PushEvent(&done);
+    };
+
+    SDL_GL_MakeCurrent(win, nullptr);
+    std::thread renderer(renderLoop);
+    SDL_Event e;
+    while (rendering && SDL_WaitEvent(&e)) {
+        if (e.type==SDL_QUIT) input.quit = true;
+        else if (!offscreen && e.type==SDL_WINDOWEVENT && e.window.event==SDL_WINDOWEVENT_SIZE_CHANGED) {
+            input.w = e.window.data1; input.h = e.window.data2;
+        }
+        else if (e.type==SDL_KEYDOWN && !lod && (e.key.keysym.sym==SDLK_PLUS || e.key.keysym.sym==SDLK_EQUALS))
+            input.wantN = std::min(input.wantN*2, 8192);
+        else if (e.type==SDL_KEYDOWN && !lod && e.key.keysym.sym==SDLK_MINUS)
+            input.wantN = std::max(input.wantN/2, 8);
+        else if (e.type==SDL_KEYDOWN && e.key.keysym.sym==SDLK_c && lutTex)
+            input.colourMap = ColourMap((input.colourMap + 1) % MAP_COUNT);
+        else continue;
+        inputs.publish(input);
+    }
+    renderer.join();
+    SDL_GL_MakeCurrent(win, ctx);
+
+    if (benchFrames > 0) {
+        glFinish();
+        const double sec = msSince(benchStart)*1e-3;
+        printf("bench: %d frames, N=%s%s %s %s, %zu tris/frame, %dx%d%s\n",
+               benchFrames, lod ? "lod" : std::to_string(drawn ? scene.N : mesh.N).c_str(),
+               wall ? (" x" + std::to_string(instanceCount)).c_str() : drawn ? (" scene x" + std::to_string(sceneCount)).c_str() : "",
+               gpuEval ? "gpu" : "cpu",
+               topologyNames[meshOpt.topology], benchTriangles/benchFrames, w, h,
+               offscreen ? " offscreen" : "");
+        printf("bench: %.3f s, %.1f frames/s, %.3g triangles/s\n",
+               sec, benchFrames/sec, double(benchTriangles)/sec);
+    }
+
+    if (timed) {
+        frameStats.flush();
+        if (stats) { frameStats.report(stdout, gpuTimer.method()); reportScratch(); }
+        gpuTimer.shutdown();
+    }
+    if (capture.active()) {
+        capture.close();
+        // stdout may be the stream itself
+        fprintf(stderr,"capture: %llu frames written, %llu dropped\n",
+                (unsigned long long)capture.written, (unsigned long long)capture.dropped);
+    }
+    builder.shutdown();
+    lodChain.destroy();
+    if (drawn) destroyScene(scene);
+    if (mesh.vbo) destroyMesh(mesh);
+    if (wall) destroyInstances(instances);
+    destroyProgram(prog);
+    if (lutTex) glDeleteTextures(1, &lutTex);
+    if (upscaler.program) destroyUpscaler(upscaler);
+    if (scaled.fbo) destroyFramebuffer(scaled);
+    if (offscreen) destroyFramebuffer(target);
     SDL_GL_DeleteContext(ctx);
     SDL_DestroyWindow(win);
     SDL_Quit();